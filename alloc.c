@@ -0,0 +1,235 @@
+
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "idlemon.h"
+
+// Built with -DALLOC_CHECK, malloc() and friends are replaced with wrappers
+// counting the allocations made on the main thread, and a tick that makes any
+// is fatal. Plugin callbacks are left out with alloc_pause(), plugins allocate
+// as they please, and the X queries run on a thread of their own.
+
+#ifdef ALLOC_CHECK
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void __libc_free(void *p);
+void *__libc_memalign(size_t align, size_t size);
+void *__libc_valloc(size_t size);
+void *__libc_pvalloc(size_t size);
+
+void *aligned_alloc(size_t align, size_t size);
+
+static pthread_t main_thread;
+static bool counting = false;
+static unsigned paused = 0;
+static uint64_t allocs = 0;
+static uint64_t frees = 0;
+static uint64_t tick_allocs = 0;
+static uint64_t ticks = 0;
+
+
+__attribute__((constructor))
+static void
+alloc_init(void)
+{
+	main_thread = pthread_self();
+	counting = true;
+}
+
+static inline bool
+counted(void)
+{
+	return counting && paused == 0 && pthread_equal(pthread_self(), main_thread);
+}
+
+void *
+malloc(size_t size)
+{
+	void *p = __libc_malloc(size);
+
+	if (p != NULL && counted()) {
+		allocs++;
+	}
+	return p;
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	void *p = __libc_calloc(n, size);
+
+	if (p != NULL && counted()) {
+		allocs++;
+	}
+	return p;
+}
+
+void *
+realloc(void *old, size_t size)
+{
+	void *p = __libc_realloc(old, size);
+
+	// Resizing in place still counts, it may as well have moved
+	if (counted()) {
+		if (old == NULL && p != NULL) {
+			allocs++;
+		} else if (old != NULL && size == 0) {
+			frees++;
+		} else if (p != NULL) {
+			allocs++;
+			frees++;
+		}
+	}
+	return p;
+}
+
+void
+free(void *p)
+{
+	if (p != NULL && counted()) {
+		frees++;
+	}
+	__libc_free(p);
+}
+
+void *
+memalign(size_t align, size_t size)
+{
+	void *p = __libc_memalign(align, size);
+
+	if (p != NULL && counted()) {
+		allocs++;
+	}
+	return p;
+}
+
+void *
+aligned_alloc(size_t align, size_t size)
+{
+	return memalign(align, size);
+}
+
+int
+posix_memalign(void **out, size_t align, size_t size)
+{
+	if (align < sizeof(void *) || (align & (align - 1)) != 0) {
+		return EINVAL;
+	}
+	if ((*out = memalign(align, size)) == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+void *
+valloc(size_t size)
+{
+	void *p = __libc_valloc(size);
+
+	if (p != NULL && counted()) {
+		allocs++;
+	}
+	return p;
+}
+
+void *
+pvalloc(size_t size)
+{
+	void *p = __libc_pvalloc(size);
+
+	if (p != NULL && counted()) {
+		allocs++;
+	}
+	return p;
+}
+
+void
+alloc_pause(void)
+{
+	paused++;
+}
+
+void
+alloc_resume(void)
+{
+	paused--;
+}
+
+void
+alloc_tick_begin(void)
+{
+	tick_allocs = allocs;
+}
+
+void
+alloc_tick_end(void)
+{
+	ticks++;
+	if (allocs != tick_allocs) {
+		log_fatal("alloc: tick %llu made %llu heap allocations",
+				(unsigned long long)ticks, (unsigned long long)(allocs - tick_allocs));
+	}
+}
+
+void
+alloc_usage(struct alloc_usage *u)
+{
+	u->allocs = allocs;
+	u->live = allocs - frees;
+	u->in_use = mallinfo2().uordblks;
+}
+
+#else
+
+void
+alloc_pause(void)
+{
+}
+
+void
+alloc_resume(void)
+{
+}
+
+void
+alloc_tick_begin(void)
+{
+}
+
+void
+alloc_tick_end(void)
+{
+}
+
+void
+alloc_usage(struct alloc_usage *u)
+{
+	u->allocs = 0;
+	u->live = 0;
+	u->in_use = mallinfo2().uordblks;
+}
+
+#endif
+
+// Logs the heap allocations made since before was taken.
+void
+alloc_report(const char *what, const struct alloc_usage *before)
+{
+	struct alloc_usage now;
+
+	alloc_usage(&now);
+#ifdef ALLOC_CHECK
+	log_info("alloc: %s made %llu allocations, %+lld live, %+lld bytes in use", what,
+			(unsigned long long)(now.allocs - before->allocs),
+			(long long)(now.live - before->live),
+			(long long)now.in_use - (long long)before->in_use);
+#else
+	log_info("alloc: %s changed the heap in use by %+lld bytes", what,
+			(long long)now.in_use - (long long)before->in_use);
+#endif
+}
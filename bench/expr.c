@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../idlemon.h"
+#include "../trace.h"
+
+// Cost of evaluating start conditions on every tick, against comparing the
+// idle time with a delay as task_process() does without one. idle changes
+// on every tick, so only expressions that don't refer to it are cached.
+
+#define TICKS 200
+
+bool color_tty = false;
+struct config config = CONFIG_INIT;
+
+static const char *const exprs[] = {
+	"idle > 10m && !xss && load1 < 2",
+	"xss || idle > 1h",
+	"xss && load1 < 2",
+};
+
+static void
+bench_delay(size_t n)
+{
+	unsigned long *delays;
+	struct state state = {0};
+	volatile unsigned hits = 0;
+	uint64_t t;
+
+	if ((delays = malloc(n * sizeof(*delays))) == NULL) {
+		log_fatal("bench: malloc failed:");
+	}
+	for (size_t i = 0; i < n; i++) {
+		delays[i] = 600000;
+	}
+
+	t = trace_now();
+	for (int tick = 0; tick < TICKS; tick++) {
+		state.idle = tick * 1000;
+		for (size_t i = 0; i < n; i++) {
+			hits += state.idle >= delays[i];
+		}
+	}
+	t = trace_now() - t;
+
+	printf("%-34s %8zu %8.1f\n", "(delay compare)", n, (double)t / n / TICKS);
+	free(delays);
+}
+
+static void
+bench_expr(const char *src, size_t n)
+{
+	struct expr **es;
+	struct state state = { .load = { 0.5 } };
+	volatile unsigned hits = 0;
+	char err[128];
+	uint64_t t;
+
+	if ((es = malloc(n * sizeof(*es))) == NULL) {
+		log_fatal("bench: malloc failed:");
+	}
+	for (size_t i = 0; i < n; i++) {
+		if ((es[i] = expr_compile(src, err, sizeof(err))) == NULL) {
+			log_fatal("bench: %s: %s", src, err);
+		}
+	}
+
+	t = trace_now();
+	for (int tick = 0; tick < TICKS; tick++) {
+		state.idle = tick * 1000;
+		for (size_t i = 0; i < n; i++) {
+			hits += expr_eval(es[i], &state);
+		}
+	}
+	t = trace_now() - t;
+
+	printf("%-34s %8zu %8.1f\n", src, n, (double)t / n / TICKS);
+	for (size_t i = 0; i < n; i++) {
+		free(es[i]);
+	}
+	free(es);
+}
+
+int
+main(void)
+{
+	static const size_t sizes[] = { 100, 10000, 100000 };
+
+	printf("%-34s %8s %8s\n", "start condition", "tasks", "ns/task");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		bench_delay(sizes[i]);
+		for (size_t j = 0; j < sizeof(exprs) / sizeof(*exprs); j++) {
+			bench_expr(exprs[j], sizes[i]);
+		}
+	}
+	return 0;
+}
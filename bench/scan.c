@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../idlemon.h"
+#include "../trace.h"
+
+// Cost of the task_process() scan on a tick where nothing is due, with a
+// mix of pending and completed tasks. This is the loop the split between
+// struct task and struct taskinfo keeps to the hot fields.
+
+#define TICKS 1000
+
+bool color_tty = false;
+struct config config = CONFIG_INIT;
+
+static void
+bench_scan(size_t n)
+{
+	struct tasklist list = {0};
+	struct state state = { .idle = 1000 };
+	struct state prev_state = { .idle = 500 };
+	uint64_t t;
+
+	for (size_t i = 0; i < n; i++) {
+		struct task task = {
+			.delay = 1000000 + i,
+			.state = i % 3 == 0 ? TASK_COMPLETED : TASK_PENDING,
+		};
+		struct taskinfo info = {0};
+		char name[32];
+
+		snprintf(name, sizeof(name), "task %zu", i);
+		if ((info.name = strdup(name)) == NULL || !tasklist_append(&list, &task, &info)) {
+			log_fatal("bench: out of memory");
+		}
+		// Spread the cold data over the heap like a config loaded in one
+		// go with other allocations in between
+		free(malloc(64 + i % 128));
+	}
+
+	t = trace_now();
+	for (int tick = 0; tick < TICKS; tick++) {
+		for (size_t i = 0; i < list.len; i++) {
+			task_process(&list, i, 0, &state, &prev_state);
+		}
+	}
+	t = trace_now() - t;
+
+	printf("%8zu %8.1f\n", n, (double)t / n / TICKS);
+	tasklist_deinit(&list);
+}
+
+int
+main(void)
+{
+	static const size_t sizes[] = { 1000, 100000, 1000000 };
+
+	printf("%8s %8s\n", "tasks", "ns/task");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+		bench_scan(sizes[i]);
+	}
+	return 0;
+}
@@ -0,0 +1,304 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "idlemon.h"
+
+
+static const struct {
+	const char *name;
+	enum builtin kind;
+	size_t min_args;
+	size_t max_args;
+	const char *usage;
+} builtins[] = {
+	{ "dpms",   BUILTIN_DPMS,   1, 1,        "dpms <on|standby|suspend|off>" },
+	{ "write",  BUILTIN_WRITE,  2, 2,        "write <path> <value>" },
+	{ "touch",  BUILTIN_TOUCH,  1, 1,        "touch <path>" },
+	{ "signal", BUILTIN_SIGNAL, 1, 2,        "signal <pidfile> [signal]" },
+	{ "notify", BUILTIN_NOTIFY, 2, SIZE_MAX, "notify <socket> <message>..." },
+};
+
+static const struct {
+	const char *name;
+	int sig;
+} signals[] = {
+	{ "HUP",  SIGHUP },
+	{ "INT",  SIGINT },
+	{ "QUIT", SIGQUIT },
+	{ "KILL", SIGKILL },
+	{ "USR1", SIGUSR1 },
+	{ "USR2", SIGUSR2 },
+	{ "TERM", SIGTERM },
+	{ "CONT", SIGCONT },
+	{ "STOP", SIGSTOP },
+};
+
+static const char *dpms_levels[] = {
+	[DPMS_ON] = "on",
+	[DPMS_STANDBY] = "standby",
+	[DPMS_SUSPEND] = "suspend",
+	[DPMS_OFF] = "off",
+};
+
+
+static int
+parse_dpms_level(const char *s)
+{
+	for (size_t i = 0; i < sizeof(dpms_levels) / sizeof(*dpms_levels); i++) {
+		if (strcasecmp(s, dpms_levels[i]) == 0) {
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+static int
+parse_signal(const char *s)
+{
+	char *end;
+	long n;
+
+	if (strncasecmp(s, "SIG", 3) == 0) {
+		s += 3;
+	}
+
+	for (size_t i = 0; i < sizeof(signals) / sizeof(*signals); i++) {
+		if (strcasecmp(s, signals[i].name) == 0) {
+			return signals[i].sig;
+		}
+	}
+
+	errno = 0;
+	n = strtol(s, &end, 10);
+	if (errno != 0 || end == s || *end != '\0' || n <= 0 || n >= 64) {
+		return -1;
+	}
+	return (int)n;
+}
+
+enum builtin
+builtin_parse(char *const *argv)
+{
+	size_t argc = 0;
+
+	for (char *const *p = argv + 1; *p != NULL; p++) {
+		argc++;
+	}
+
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(*builtins); i++) {
+		if (strcasecmp(argv[0], builtins[i].name) != 0) {
+			continue;
+		}
+
+		if (argc < builtins[i].min_args || argc > builtins[i].max_args) {
+			log_error("config: usage: builtin = %s", builtins[i].usage);
+			return BUILTIN_NONE;
+		}
+
+		switch (builtins[i].kind) {
+		case BUILTIN_DPMS:
+			if (parse_dpms_level(argv[1]) == -1) {
+				log_error("config: invalid dpms level '%s'", argv[1]);
+				return BUILTIN_NONE;
+			}
+			break;
+		case BUILTIN_SIGNAL:
+			if (argc > 1 && parse_signal(argv[2]) == -1) {
+				log_error("config: invalid signal '%s'", argv[2]);
+				return BUILTIN_NONE;
+			}
+			break;
+		default:
+			break;
+		}
+		return builtins[i].kind;
+	}
+
+	log_error("config: unknown builtin '%s'", argv[0]);
+	return BUILTIN_NONE;
+}
+
+static bool
+write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool
+builtin_write(const struct taskinfo *info)
+{
+	const char *path = info->argv[1];
+	const char *value = info->argv[2];
+	bool ok;
+	int fd;
+
+	// sysfs attributes can't be created or truncated so only ask for that
+	// on regular files.
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1 &&
+			(fd = open(path, O_WRONLY | O_CLOEXEC)) == -1) {
+		log_error("task: [%s] failed to open %s:", info->name, path);
+		return false;
+	}
+
+	ok = write_all(fd, value, strlen(value)) && write_all(fd, "\n", 1);
+	if (!ok) {
+		log_error("task: [%s] failed to write %s:", info->name, path);
+	}
+	if (close(fd) == -1 && ok) {
+		log_error("task: [%s] failed to write %s:", info->name, path);
+		ok = false;
+	}
+	return ok;
+}
+
+static bool
+builtin_touch(const struct taskinfo *info)
+{
+	const char *path = info->argv[1];
+	bool ok = true;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+		log_error("task: [%s] failed to open %s:", info->name, path);
+		return false;
+	}
+	if (futimens(fd, NULL) == -1) {
+		log_error("task: [%s] failed to update times of %s:", info->name, path);
+		ok = false;
+	}
+	close(fd);
+	return ok;
+}
+
+static bool
+builtin_signal(const struct taskinfo *info)
+{
+	const char *path = info->argv[1];
+	int sig = info->argv[2] != NULL ? parse_signal(info->argv[2]) : SIGTERM;
+	char buf[32];
+	ssize_t n;
+	char *end;
+	long pid;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		log_error("task: [%s] failed to open %s:", info->name, path);
+		return false;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		log_error("task: [%s] failed to read %s:", info->name, path);
+		return false;
+	}
+	buf[n] = '\0';
+
+	errno = 0;
+	pid = strtol(strltrim(buf), &end, 10);
+	if (errno != 0 || pid <= 0 || (*end != '\0' && *strltrim(end) != '\0')) {
+		log_error("task: [%s] invalid pid in %s", info->name, path);
+		return false;
+	}
+
+	if (kill((pid_t)pid, sig) == -1) {
+		log_error("task: [%s] failed to signal %ld:", info->name, pid);
+		return false;
+	}
+	return true;
+}
+
+static bool
+builtin_notify(const struct taskinfo *info)
+{
+	const char *path = info->argv[1];
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	char msg[512];
+	size_t len = 0;
+	bool ok = false;
+	int fd = -1;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_error("task: [%s] socket path too long", info->name);
+		return false;
+	}
+	strcpy(addr.sun_path, path);
+
+	for (char *const *p = info->argv + 2; *p != NULL; p++) {
+		int r = snprintf(msg + len, sizeof(msg) - len, "%s%s",
+				p == info->argv + 2 ? "" : " ", *p);
+		if (r < 0 || (size_t)r >= sizeof(msg) - len - 1) {
+			log_error("task: [%s] message too long", info->name);
+			return false;
+		}
+		len += r;
+	}
+	msg[len++] = '\n';
+
+	// Datagram sockets get the message as a single packet, stream sockets
+	// as a newline terminated line.
+	for (int type = SOCK_DGRAM;; type = SOCK_STREAM) {
+		if ((fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0)) == -1) {
+			log_error("task: [%s] failed to create socket:", info->name);
+			return false;
+		}
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			break;
+		}
+		if (errno != EPROTOTYPE || type == SOCK_STREAM) {
+			close(fd);
+			log_error("task: [%s] failed to connect to %s:", info->name, path);
+			return false;
+		}
+		close(fd);
+	}
+
+	if (send(fd, msg, len, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)len) {
+		ok = true;
+	} else {
+		log_error("task: [%s] failed to send to %s:", info->name, path);
+	}
+	close(fd);
+	return ok;
+}
+
+bool
+builtin_run(const struct task *task, const struct taskinfo *info)
+{
+	switch (info->builtin) {
+	case BUILTIN_DPMS:
+		return xss_dpms(task->display, parse_dpms_level(info->argv[1]));
+	case BUILTIN_WRITE:
+		return builtin_write(info);
+	case BUILTIN_TOUCH:
+		return builtin_touch(info);
+	case BUILTIN_SIGNAL:
+		return builtin_signal(info);
+	case BUILTIN_NOTIFY:
+		return builtin_notify(info);
+	case BUILTIN_NONE:
+		break;
+	}
+	return false;
+}
@@ -1,4 +1,5 @@
 
+#include <ctype.h>
 #include <errno.h>
 #include <limits.h>
 #include <stdio.h>
@@ -8,45 +9,471 @@
 
 #include "idlemon.h"
 
-#define MAX_ARGS 32
+extern char **environ;
+
+// Fields are accumulated as consecutive NUL terminated strings and then
+// packed behind their pointer array in a single allocation, so an argv is
+// copied with argv_dup() and released with a single free().
+struct fields {
+	char *buf;
+	size_t len;
+	size_t cap;
+	size_t n;
+};
+
+static bool
+fields_putc(struct fields *f, char c)
+{
+	if (f->len >= f->cap) {
+		size_t cap = f->cap == 0 ? 64 : f->cap * 2;
+		char *buf = realloc(f->buf, cap);
+		if (buf == NULL) {
+			log_error("config: realloc failed:");
+			return false;
+		}
+		f->buf = buf;
+		f->cap = cap;
+	}
+	f->buf[f->len++] = c;
+	return true;
+}
+
+static bool
+fields_puts(struct fields *f, const char *s, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		if (!fields_putc(f, s[i])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool
+fields_end(struct fields *f)
+{
+	if (!fields_putc(f, '\0')) {
+		return false;
+	}
+	f->n++;
+	return true;
+}
 
-// TODO: Support parsing quoted arguments. Also allocate fields on heap
-//       so there's no maximum number.
 static char **
-parse_argv(char *s)
+fields_pack(struct fields *f)
 {
-	char *field_save = NULL;
-	char *fields[MAX_ARGS + 1];
-	size_t fields_len = 0;
+	size_t ptrs = (f->n + 1) * sizeof(char *);
 	char **argv;
+	char *s;
+
+	if ((argv = malloc(ptrs + f->len)) == NULL) {
+		log_error("config: malloc failed:");
+		return NULL;
+	}
+
+	s = (char *)argv + ptrs;
+	if (f->len > 0) {
+		memcpy(s, f->buf, f->len);
+	}
+	for (size_t i = 0; i < f->n; i++) {
+		argv[i] = s;
+		s += strlen(s) + 1;
+	}
+	argv[f->n] = NULL;
+	return argv;
+}
+
+// Expands the variable at s, which points at a '$', and returns a pointer
+// to the last character consumed.
+static const char *
+expand_var(struct fields *f, const char *s)
+{
+	char name[256];
+	const char *end, *val;
+	size_t len;
+
+	if (s[1] == '{') {
+		if ((end = strchr(s + 2, '}')) == NULL) {
+			log_error("config: missing '}' in variable");
+			return NULL;
+		}
+		if ((len = end - (s + 2)) == 0) {
+			log_error("config: empty variable name");
+			return NULL;
+		}
+		s += 2;
+	} else {
+		for (end = s + 1; *end == '_' || isalnum((unsigned char)*end); end++) {
+		}
+		len = end - (s + 1);
+		s += 1;
+		end--;
+	}
+
+	if (len == 0) {
+		// Not a variable so keep the '$' as is
+		return fields_putc(f, '$') ? s - 1 : NULL;
+	}
+	if (len >= sizeof(name)) {
+		log_error("config: variable name too long");
+		return NULL;
+	}
+	memcpy(name, s, len);
+	name[len] = '\0';
+
+	if ((val = getenv(name)) != NULL && !fields_puts(f, val, strlen(val))) {
+		return NULL;
+	}
+	return end;
+}
+
+// Splits s into fields like a POSIX shell would: fields are separated by
+// blanks, single quotes preserve everything up to the closing quote, double
+// quotes allow escaping '"', '\\' and '$' with a backslash and outside of
+// quotes a backslash escapes any character. When expand is set $NAME and
+// ${NAME} outside of single quotes are replaced with the environment value.
+// If literal isn't NULL it's set to an array telling for each field whether
+// it was written out as is, without quotes, escapes or variables.
+static char **
+split_fields(const char *s, bool expand, bool **literal)
+{
+	struct fields f = {0};
+	bool *lits = NULL;
+	size_t lits_cap = 0;
+	char **argv = NULL;
+
+	for (;;) {
+		char quote = '\0';
+		bool quoted = false;
+		bool plain = true;
+		size_t start;
+
+		while (*s == ' ' || *s == '\t') {
+			s++;
+		}
+		if (*s == '\0') {
+			break;
+		}
 
-	for (char *field = strtok_r(s, " \t", &field_save); field != NULL;
-			field = strtok_r(NULL, " \t", &field_save)) {
-		if (fields_len >= MAX_ARGS) {
-			log_error("config: too many arguments");
+		start = f.len;
+		for (; *s != '\0'; s++) {
+			char c = *s;
+
+			if (quote == '\'') {
+				if (c == '\'') {
+					quote = '\0';
+				} else if (!fields_putc(&f, c)) {
+					goto failed;
+				}
+				continue;
+			}
+
+			if (c == '\\') {
+				char next = s[1];
+
+				plain = false;
+				if (next == '\0') {
+					log_error("config: trailing backslash");
+					goto failed;
+				}
+				if (quote == '"' && next != '"' && next != '\\' && next != '$' &&
+						!fields_putc(&f, '\\')) {
+					goto failed;
+				}
+				if (!fields_putc(&f, next)) {
+					goto failed;
+				}
+				s++;
+				continue;
+			}
+
+			if (quote == '"') {
+				if (c == '"') {
+					quote = '\0';
+					continue;
+				}
+			} else if (c == ' ' || c == '\t') {
+				break;
+			} else if (c == '\'' || c == '"') {
+				quote = c;
+				quoted = true;
+				plain = false;
+				continue;
+			}
+
+			if (c == '$' && expand) {
+				plain = false;
+				if ((s = expand_var(&f, s)) == NULL) {
+					goto failed;
+				}
+				continue;
+			}
+
+			if (!fields_putc(&f, c)) {
+				goto failed;
+			}
+		}
+
+		if (quote != '\0') {
+			log_error("config: missing closing quote (%c)", quote);
 			goto failed;
 		}
-		if ((fields[fields_len++] = strdup(field)) == NULL) {
-			log_error("config: strdup failed:");
+		// Like the shell, drop unquoted fields that expanded to nothing
+		if (f.len == start && !quoted) {
+			continue;
+		}
+		if (literal != NULL) {
+			if (f.n >= lits_cap) {
+				size_t cap = lits_cap == 0 ? 16 : lits_cap * 2;
+				bool *l = realloc(lits, cap * sizeof(*l));
+
+				if (l == NULL) {
+					log_error("config: realloc failed:");
+					goto failed;
+				}
+				lits = l;
+				lits_cap = cap;
+			}
+			lits[f.n] = plain;
+		}
+		if (!fields_end(&f)) {
 			goto failed;
 		}
 	}
 
-	fields[fields_len++] = NULL;
-	if ((argv = malloc(sizeof(*argv) * fields_len)) == NULL) {
-		log_error("config: malloc failed:");
+	if (f.n == 0) {
+		log_error("config: no arguments");
 		goto failed;
 	}
-	memcpy(argv, fields, sizeof(*argv) * fields_len);
+	if ((argv = fields_pack(&f)) != NULL && literal != NULL) {
+		*literal = lits;
+		lits = NULL;
+	}
+
+failed:
+	free(f.buf);
+	free(lits);
 	return argv;
+}
+
+static char **
+parse_argv(const char *s, bool expand)
+{
+	return split_fields(s, expand, NULL);
+}
+
+// Whether field i of a pipeline separates two stages, a "|" that isn't quoted
+// or escaped.
+static bool
+is_pipe(char *const *argv, const bool *literal, size_t i)
+{
+	return literal[i] && strcmp(argv[i], "|") == 0;
+}
+
+// Parses a pipeline into info->argv and splits it into its stages at each
+// lone "|".
+static bool
+parse_pipeline(struct taskinfo *info, const char *s, bool expand)
+{
+	char **argv;
+	bool *literal = NULL;
+	size_t n = 1;
+	bool ok = false;
+
+	if ((info->argv = argv = split_fields(s, expand, &literal)) == NULL) {
+		return false;
+	}
+
+	for (size_t i = 0; argv[i] != NULL; i++) {
+		if (!is_pipe(argv, literal, i)) {
+			continue;
+		}
+		if (i == 0 || argv[i + 1] == NULL || is_pipe(argv, literal, i + 1)) {
+			log_error("config: empty pipeline stage");
+			goto failed;
+		}
+		n++;
+	}
+	if (n < 2) {
+		log_error("config: pipeline needs at least two stages");
+		goto failed;
+	}
+
+	if ((info->stages = calloc(n, sizeof(*info->stages))) == NULL) {
+		log_error("config: calloc failed:");
+		goto failed;
+	}
+	info->stages_len = n;
+
+	for (size_t i = 0, start = 0; i < n; i++) {
+		struct fields f = {0};
+		size_t end = start;
+
+		for (; argv[end] != NULL && !is_pipe(argv, literal, end); end++) {
+			if (!fields_puts(&f, argv[end], strlen(argv[end])) || !fields_end(&f)) {
+				free(f.buf);
+				goto failed;
+			}
+		}
+		info->stages[i].argv = fields_pack(&f);
+		free(f.buf);
+		if (info->stages[i].argv == NULL) {
+			goto failed;
+		}
+		start = end + 1;
+	}
+	ok = true;
+
+failed:
+	free(literal);
+	return ok;
+}
+
+static char **
+parse_list(char *s)
+{
+	struct fields f = {0};
+	char *field_save = NULL;
+	char **list = NULL;
+
+	for (char *field = strtok_r(s, ",", &field_save); field != NULL;
+			field = strtok_r(NULL, ",", &field_save)) {
+		field = strntrim(field, strlen(field));
+		if (*field == '\0') {
+			continue;
+		}
+		if (!fields_puts(&f, field, strlen(field)) || !fields_end(&f)) {
+			goto failed;
+		}
+	}
+
+	if (f.n == 0) {
+		log_error("config: empty list");
+		goto failed;
+	}
+	list = fields_pack(&f);
 
 failed:
-	for (size_t i = 0; i < fields_len; i++) {
-		if (fields[i] != NULL) {
-			free(fields[i]);
+	free(f.buf);
+	return list;
+}
+
+// Parses a comma separated list of power states into POWER_* flags.
+static bool
+parse_power(char *s, uint8_t *flags)
+{
+	static const struct {
+		const char *name;
+		uint8_t flag;
+	} states[] = {
+		{ "ac", POWER_AC },
+		{ "battery", POWER_BATTERY },
+		{ "lid_closed", POWER_LID_CLOSED },
+	};
+	char **list;
+	bool valid = true;
+
+	if ((list = parse_list(s)) == NULL) {
+		return false;
+	}
+	for (char **p = list; *p != NULL && valid; p++) {
+		valid = false;
+		strtolower(*p);
+		for (size_t i = 0; i < sizeof(states) / sizeof(*states); i++) {
+			if (strcmp(*p, states[i].name) == 0) {
+				*flags |= states[i].flag;
+				valid = true;
+				break;
+			}
+		}
+		if (!valid) {
+			log_error("config: unknown power state '%s'", *p);
+		}
+	}
+	free(list);
+	return valid;
+}
+
+static bool
+env_contains(char *const *env, const char *entry)
+{
+	size_t len = strcspn(entry, "=");
+
+	for (char *const *e = env; e != NULL && *e != NULL; e++) {
+		if (strncmp(*e, entry, len) == 0 && (*e)[len] == '=') {
+			return true;
 		}
 	}
-	return NULL;
+	return false;
+}
+
+// Builds the complete environment of a task once so launching it doesn't
+// need to.
+static bool
+build_envp(struct taskinfo *info)
+{
+	struct fields f = {0};
+	bool built = false;
+
+	if (info->env == NULL && !info->env_clear) {
+		return true;
+	}
+
+	if (!info->env_clear) {
+		for (char **e = environ; *e != NULL; e++) {
+			if (env_contains(info->env, *e)) {
+				continue;
+			}
+			if (!fields_puts(&f, *e, strlen(*e)) || !fields_end(&f)) {
+				goto failed;
+			}
+		}
+	}
+	for (char **e = info->env; e != NULL && *e != NULL; e++) {
+		if (!fields_puts(&f, *e, strlen(*e)) || !fields_end(&f)) {
+			goto failed;
+		}
+	}
+
+	if ((info->envp = fields_pack(&f)) != NULL) {
+		free(info->env);
+		info->env = NULL;
+		built = true;
+	}
+
+failed:
+	free(f.buf);
+	return built;
+}
+
+// Copies a path, replacing a leading '~' with $HOME.
+static char *
+parse_path(const char *s)
+{
+	const char *home;
+	size_t home_len, len;
+	char *path;
+
+	if (s[0] != '~' || (s[1] != '/' && s[1] != '\0')) {
+		if ((path = strdup(s)) == NULL) {
+			log_error("config: strdup failed:");
+		}
+		return path;
+	}
+	if ((home = getenv("HOME")) == NULL || *home == '\0') {
+		log_error("config: HOME isn't set to expand '%s'", s);
+		return NULL;
+	}
+
+	home_len = strlen(home);
+	len = strlen(s + 1);
+	if ((path = malloc(home_len + len + 1)) == NULL) {
+		log_error("config: malloc failed:");
+		return NULL;
+	}
+	memcpy(path, home, home_len);
+	memcpy(path + home_len, s + 1, len + 1);
+	return path;
 }
 
 static unsigned long
@@ -105,31 +532,167 @@ parse_duration(char *s)
 }
 
 static bool
-append_task(struct config *cfg, struct task *task, size_t section_line_num)
+append_task(struct config *cfg, struct task *task, struct taskinfo *info,
+		size_t section_line_num)
 {
-	if (task->name == NULL) {
+	if (info->name == NULL) {
 		log_error("config: 'name' required for task on line %zu", section_line_num);
 		return false;
 	}
-	if (task->argv == NULL) {
-		log_error("config: 'argv' required for task on line %zu", section_line_num);
+	if (info->argv == NULL) {
+		log_error("config: 'argv', 'builtin', 'pipeline' or 'plugin' required for task on line %zu",
+				section_line_num);
+		return false;
+	}
+	if (info->capture != NULL) {
+		if (!(task->flags & TASK_PIPELINE)) {
+			log_error("config: 'capture' needs 'pipeline' for task on line %zu",
+					section_line_num);
+			return false;
+		}
+		if (info->capture_stage == 0) {
+			info->capture_stage = info->stages_len;
+		} else if (info->capture_stage > info->stages_len) {
+			log_error("config: no stage %zu to capture for task on line %zu",
+					info->capture_stage, section_line_num);
+			return false;
+		}
+	}
+	if ((task->flags & TASK_START_EXPR) && task->delay != 0) {
+		log_error("config: only one of 'delay' or 'start' allowed for task on line %zu",
+				section_line_num);
 		return false;
 	}
 	if (task->delay == 0) {
 		task->delay = cfg->delay;
 	}
-	if (!tasklist_append(&cfg->tasks, task)) {
+	if (!build_envp(info)) {
+		log_error("config: failed to build environment for task on line %zu",
+				section_line_num);
+		return false;
+	}
+	if (!(task->flags & (TASK_BUILTIN | TASK_PLUGIN)) && !task_resolve(info)) {
+		const char *name = info->argv[0];
+
+		for (size_t i = 0; i < info->stages_len; i++) {
+			if (info->stages[i].path == NULL) {
+				name = info->stages[i].argv[0];
+				break;
+			}
+		}
+		log_warn("config: '%s' not found for task on line %zu", name,
+				section_line_num);
+	}
+	if (!tasklist_append(&cfg->tasks, task, info)) {
 		log_error("config: failed to append task:");
 		return false;
 	}
 	memset(task, 0, sizeof(*task));
+	memset(info, 0, sizeof(*info));
 	return true;
 }
 
-bool
-config_load(const char *filename, struct config *cfg)
+static bool
+resolve_deps(struct tasklist *tasks)
+{
+	for (size_t i = 0; i < tasks->len; i++) {
+		struct taskinfo *info = &tasks->info[tasks->entries[i].id];
+		size_t n = 0;
+
+		if (info->after == NULL) {
+			continue;
+		}
+
+		for (char **p = info->after; *p != NULL; p++) {
+			n++;
+		}
+		if ((info->deps = calloc(n, sizeof(*info->deps))) == NULL) {
+			log_error("config: calloc failed:");
+			return false;
+		}
+
+		for (char **p = info->after; *p != NULL; p++) {
+			size_t j;
+
+			for (j = 0; j < tasks->len; j++) {
+				if (strcmp(tasks->info[tasks->entries[j].id].name, *p) == 0) {
+					break;
+				}
+			}
+			if (j == tasks->len) {
+				log_error("config: task '%s' depends on unknown task '%s'",
+						info->name, *p);
+				return false;
+			}
+			if (j == i) {
+				log_error("config: task '%s' depends on itself", info->name);
+				return false;
+			}
+			info->deps[info->deps_len++] = tasks->entries[j].id;
+		}
+	}
+	return true;
+}
+
+// Depth first search over the dependencies to ensure they form a DAG.
+static bool
+check_cycles(const struct tasklist *tasks, uint32_t id, unsigned char *marks)
+{
+	const struct taskinfo *info = &tasks->info[id];
+
+	switch (marks[id]) {
+	case 1:
+		log_error("config: dependency cycle involving task '%s'", info->name);
+		return false;
+	case 2:
+		return true;
+	}
+
+	marks[id] = 1;
+	for (size_t j = 0; j < info->deps_len; j++) {
+		if (!check_cycles(tasks, info->deps[j], marks)) {
+			return false;
+		}
+	}
+	marks[id] = 2;
+	return true;
+}
+
+static bool
+validate_deps(struct tasklist *tasks)
+{
+	unsigned char *marks;
+	bool valid = true;
+
+	if (!resolve_deps(tasks)) {
+		return false;
+	}
+
+	if ((marks = calloc(tasks->info_cap + 1, 1)) == NULL) {
+		log_error("config: calloc failed:");
+		return false;
+	}
+	for (size_t i = 0; valid && i < tasks->len; i++) {
+		valid = check_cycles(tasks, tasks->entries[i].id, marks);
+	}
+	free(marks);
+
+	// names are no longer needed once resolved
+	for (size_t i = 0; i < tasks->len; i++) {
+		struct taskinfo *info = &tasks->info[tasks->entries[i].id];
+
+		free(info->after);
+		info->after = NULL;
+	}
+	return valid;
+}
+
+// Parses the config in f. A user's config read when monitoring system wide
+// is parsed as root, so it can't load plugins: their constructors would run
+// before task_start() gets to refuse them.
+static bool
+config_parse(FILE *f, struct config *cfg, bool user)
 {
-	FILE *f;
 	char *line = NULL;
 	size_t line_cap = 0;
 	size_t line_num = 0;
@@ -141,15 +704,11 @@ config_load(const char *filename, struct config *cfg)
 		SECTION_UNKNOWN,
 	} section = SECTION_GLOBAL;
 	struct task task = {0};
+	struct taskinfo info = {0};
 	bool loaded = true;
 
 	*cfg = (struct config)CONFIG_INIT;
 
-	if ((f = fopen(filename, "r")) == NULL) {
-		log_error("config: failed to open: %s:", filename);
-		return NULL;
-	}
-
 	for (;;) {
 		ssize_t n;
 		char *s, *key, *val;
@@ -171,7 +730,7 @@ config_load(const char *filename, struct config *cfg)
 		case '#':
 			continue;
 		case '[':
-			if (section == SECTION_TASK && !append_task(cfg, &task, section_line_num)) {
+			if (section == SECTION_TASK && !append_task(cfg, &task, &info, section_line_num)) {
 				goto failed;
 			}
 
@@ -217,6 +776,116 @@ config_load(const char *filename, struct config *cfg)
 					goto failed;
 				}
 				continue;
+			} else if (strcmp(key, "expand_env") == 0) {
+				strtolower(val);
+				switch (strtobool(val)) {
+				case 0: cfg->expand_env = false; break;
+				case 1: cfg->expand_env = true;  break;
+				default:
+					log_error("config: invalid boolean value for expand_env on line %zu",
+							line_num);
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "jobs") == 0) {
+				char *end = val;
+
+				errno = 0;
+				cfg->jobs = strtoul(val, &end, 10);
+				if (errno != 0 || *end != '\0') {
+					log_error("config: invalid number for jobs on line %zu", line_num);
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "min_active") == 0) {
+				cfg->min_active = parse_duration(val);
+				if (cfg->min_active == 0 || cfg->min_active == TASK_DELAY_XSS) {
+					log_error("config: invalid min_active duration on line %zu", line_num);
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "query_timeout") == 0) {
+				cfg->query_timeout = parse_duration(val);
+				if (cfg->query_timeout == 0 || cfg->query_timeout == TASK_DELAY_XSS) {
+					log_error("config: invalid query_timeout duration on line %zu",
+							line_num);
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "on_stall") == 0) {
+				strtolower(val);
+				if (strcmp(val, "hold") == 0) {
+					cfg->stall_hold = true;
+				} else if (strcmp(val, "signal") == 0) {
+					cfg->stall_hold = false;
+				} else {
+					log_error("config: invalid on_stall value on line %zu, expected "
+							"'hold' or 'signal'", line_num);
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "min_inputs") == 0) {
+				char *end = val;
+
+				errno = 0;
+				cfg->min_inputs = strtoul(val, &end, 10);
+				if (errno != 0 || *end != '\0') {
+					log_error("config: invalid number for min_inputs on line %zu", line_num);
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "plugin_threads") == 0) {
+				char *end = val;
+
+				errno = 0;
+				cfg->plugin_threads = strtoul(val, &end, 10);
+				if (errno != 0 || *end != '\0' || cfg->plugin_threads == 0) {
+					log_error("config: invalid number for plugin_threads on line %zu",
+							line_num);
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "history") == 0) {
+				if (cfg->history != NULL) {
+					goto duplicate_key;
+				}
+				if ((cfg->history = parse_path(val)) == NULL) {
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "runs") == 0) {
+				if (cfg->runs != NULL) {
+					goto duplicate_key;
+				}
+				if ((cfg->runs = parse_path(val)) == NULL) {
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "socket") == 0) {
+				if (cfg->socket != NULL) {
+					goto duplicate_key;
+				}
+				if ((cfg->socket = parse_path(val)) == NULL) {
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "power_root") == 0) {
+				if (cfg->power_root != NULL) {
+					goto duplicate_key;
+				}
+				if ((cfg->power_root = parse_path(val)) == NULL) {
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "displays") == 0) {
+				if (cfg->displays != NULL) {
+					goto duplicate_key;
+				}
+				if ((cfg->displays = parse_argv(val, cfg->expand_env)) == NULL) {
+					log_error("config: failed to parse displays on line %zu", line_num);
+					goto failed;
+				}
+				continue;
 			}
 			break;
 
@@ -253,30 +922,98 @@ config_load(const char *filename, struct config *cfg)
 
 		case SECTION_TASK:
 			if (strcmp(key, "name") == 0) {
-				if (task.name != NULL) {
+				if (info.name != NULL) {
 					goto duplicate_key;
 				}
 				for (size_t i = 0; i < cfg->tasks.len; i++) {
-					if (strcmp(cfg->tasks.entries[i].name, val) == 0) {
+					if (strcmp(cfg->tasks.info[cfg->tasks.entries[i].id].name, val) == 0) {
 						log_error("config: duplicate task name '%s' on line %zu",
 								val, line_num);
 						goto failed;
 					}
 				}
-				if ((task.name = strdup(val)) == NULL) {
+				if ((info.name = strdup(val)) == NULL) {
 					log_error("config: strdup failed:");
 					goto failed;
 				}
 				continue;
 			} else if (strcmp(key, "argv") == 0) {
-				if (task.argv != NULL) {
-					goto duplicate_key;
+				if (info.argv != NULL) {
+					goto argv_builtin;
 				}
-				if ((task.argv = parse_argv(val)) == NULL) {
+				if ((info.argv = parse_argv(val, cfg->expand_env)) == NULL) {
 					log_error("config: failed to parse task.argv on line %zu", line_num);
 					goto failed;
 				}
 				continue;
+			} else if (strcmp(key, "builtin") == 0) {
+				if (info.argv != NULL) {
+					goto argv_builtin;
+				}
+				if ((info.argv = parse_argv(val, cfg->expand_env)) == NULL ||
+						(info.builtin = builtin_parse(info.argv)) == BUILTIN_NONE) {
+					log_error("config: failed to parse task.builtin on line %zu", line_num);
+					goto failed;
+				}
+				task.flags |= TASK_BUILTIN;
+				continue;
+			} else if (strcmp(key, "pipeline") == 0) {
+				if (info.argv != NULL) {
+					goto argv_builtin;
+				}
+				if (!parse_pipeline(&info, val, cfg->expand_env)) {
+					log_error("config: failed to parse task.pipeline on line %zu", line_num);
+					goto failed;
+				}
+				task.flags |= TASK_PIPELINE;
+				continue;
+			} else if (strcmp(key, "capture") == 0) {
+				char **argv;
+				char *end;
+
+				if (info.capture != NULL) {
+					goto duplicate_key;
+				}
+				// The file, optionally followed by the stage
+				if ((argv = parse_argv(val, cfg->expand_env)) == NULL) {
+					log_error("config: failed to parse task.capture on line %zu", line_num);
+					goto failed;
+				}
+				info.capture = parse_path(argv[0]);
+				if (argv[1] != NULL) {
+					errno = 0;
+					info.capture_stage = strtoul(argv[1], &end, 10);
+					if (errno != 0 || *end != '\0' || info.capture_stage == 0 ||
+							argv[2] != NULL) {
+						log_error("config: invalid task.capture stage on line %zu", line_num);
+						free(argv);
+						goto failed;
+					}
+				}
+				free(argv);
+				if (info.capture == NULL) {
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "plugin") == 0) {
+				if (info.argv != NULL) {
+					goto argv_builtin;
+				}
+				if (user) {
+					log_error("config: task.plugin not available system wide on line %zu",
+							line_num);
+					goto failed;
+				}
+				if ((info.argv = parse_argv(val, cfg->expand_env)) == NULL) {
+					log_error("config: failed to parse task.plugin on line %zu", line_num);
+					goto failed;
+				}
+				if ((info.plugin = plugin_load(info.argv, &info.plugin_handle)) == NULL) {
+					log_error("config: failed to load task.plugin on line %zu", line_num);
+					goto failed;
+				}
+				task.flags |= TASK_PLUGIN;
+				continue;
 			} else if (strcmp(key, "delay") == 0) {
 				if (task.delay != 0) {
 					goto duplicate_key;
@@ -286,6 +1023,126 @@ config_load(const char *filename, struct config *cfg)
 					goto failed;
 				}
 				continue;
+			} else if (strcmp(key, "start") == 0 || strcmp(key, "reset") == 0) {
+				bool start = key[0] == 's';
+				struct expr **e = start ? &info.start : &info.reset;
+				char err[128];
+
+				if (*e != NULL) {
+					goto duplicate_key;
+				}
+				if ((*e = expr_compile(val, err, sizeof(err))) == NULL) {
+					log_error("config: invalid task.%s on line %zu, %s", key, line_num, err);
+					goto failed;
+				}
+				task.flags |= start ? TASK_START_EXPR : TASK_RESET_EXPR;
+				cfg->expr_inputs |= expr_inputs(*e);
+				continue;
+			} else if (strcmp(key, "require") == 0 || strcmp(key, "forbid") == 0) {
+				uint8_t *flags = key[0] == 'r' ? &task.require : &task.forbid;
+
+				if (*flags != 0) {
+					goto duplicate_key;
+				}
+				if (!parse_power(val, flags)) {
+					log_error("config: invalid task.%s on line %zu", key, line_num);
+					goto failed;
+				}
+				cfg->expr_inputs |= (*flags & POWER_LID_CLOSED) ? EXPR_LID : 0;
+				cfg->expr_inputs |= (*flags & ~POWER_LID_CLOSED) ? EXPR_POWER : 0;
+				continue;
+			} else if (strcmp(key, "after") == 0) {
+				if (info.after != NULL) {
+					goto duplicate_key;
+				}
+				if ((info.after = parse_list(val)) == NULL) {
+					log_error("config: failed to parse task.after on line %zu", line_num);
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "cooldown") == 0) {
+				if (info.cooldown != 0) {
+					goto duplicate_key;
+				}
+				info.cooldown = parse_duration(val);
+				if (info.cooldown == 0 || info.cooldown == TASK_DELAY_XSS) {
+					log_error("config: invalid task.cooldown duration on line %zu", line_num);
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "min_interval") == 0) {
+				if (info.min_interval != 0) {
+					goto duplicate_key;
+				}
+				info.min_interval = parse_duration(val);
+				if (info.min_interval == 0 || info.min_interval == TASK_DELAY_XSS) {
+					log_error("config: invalid task.min_interval duration on line %zu",
+							line_num);
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "min_expected_idle") == 0) {
+				if (info.min_expected_idle != 0) {
+					goto duplicate_key;
+				}
+				info.min_expected_idle = parse_duration(val);
+				if (info.min_expected_idle == 0 || info.min_expected_idle == TASK_DELAY_XSS) {
+					log_error("config: invalid task.min_expected_idle duration on line %zu",
+							line_num);
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "env") == 0) {
+				if (info.env != NULL) {
+					goto duplicate_key;
+				}
+				if ((info.env = parse_argv(val, cfg->expand_env)) == NULL) {
+					log_error("config: failed to parse task.env on line %zu", line_num);
+					goto failed;
+				}
+				for (char **e = info.env; *e != NULL; e++) {
+					if (**e == '=' || strchr(*e, '=') == NULL) {
+						log_error("config: invalid task.env entry '%s' on line %zu",
+								*e, line_num);
+						goto failed;
+					}
+				}
+				continue;
+			} else if (strcmp(key, "env_clear") == 0) {
+				strtolower(val);
+				switch (strtobool(val)) {
+				case 0: info.env_clear = false; break;
+				case 1: info.env_clear = true;  break;
+				default:
+					log_error("config: invalid boolean value for task.env_clear on line %zu",
+							line_num);
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "cwd") == 0) {
+				if (info.cwd != NULL) {
+					goto duplicate_key;
+				}
+				if ((info.cwd = parse_path(val)) == NULL) {
+					goto failed;
+				}
+				continue;
+			} else if (strcmp(key, "display") == 0) {
+				if (task.display != 0) {
+					goto duplicate_key;
+				}
+				for (size_t i = 0; cfg->displays != NULL && cfg->displays[i] != NULL; i++) {
+					if (strcmp(cfg->displays[i], val) == 0) {
+						task.display = i + 1;
+						break;
+					}
+				}
+				if (task.display == 0) {
+					log_error("config: display '%s' not listed in displays on line %zu",
+							val, line_num);
+					goto failed;
+				}
+				continue;
 			}
 			break;
 
@@ -300,19 +1157,28 @@ duplicate_key:
 		log_error("config: multiple '%s' keys in section on line %zu",
 				key, line_num);
 		goto failed;
+
+argv_builtin:
+		log_error("config: only one of 'argv', 'builtin', 'pipeline' or 'plugin' allowed in section on line %zu",
+				line_num);
+		goto failed;
 	}
 
 	if (section == SECTION_TASK) {
-		if (!append_task(cfg, &task, section_line_num)) {
+		if (!append_task(cfg, &task, &info, section_line_num)) {
 			goto failed;
 		}
 	}
 
+	if (!validate_deps(&cfg->tasks)) {
+		goto failed;
+	}
+
 	goto cleanup;
 
 failed:
 	config_deinit(cfg);
-	task_deinit(&task);
+	task_deinit(&info);
 
 	memset(cfg, 0, sizeof(*cfg));
 	loaded = false;
@@ -321,33 +1187,64 @@ cleanup:
 	if (line != NULL) {
 		free(line);
 	}
-	fclose(f);
 	return loaded;
 }
 
 bool
-config_load_and_swap(const char *filename)
+config_load(const char *filename, struct config *cfg)
 {
-	struct config cfg;
+	FILE *f;
+	bool loaded;
 
-	if (!config_load(filename, &cfg)) {
+	if ((f = fopen(filename, "r")) == NULL) {
+		log_error("config: failed to open: %s:", filename);
 		return false;
 	}
+	loaded = config_parse(f, cfg, false);
+	fclose(f);
+	return loaded;
+}
 
+// Replaces *cur with cfg, carrying over the state of tasks that are still
+// there.
+static bool
+config_merge(struct config *cur, struct config cfg, const char *filename)
+{
 	// Merge new tasks with existing old ones so we don't lose track of
 	// those that are already started/completed.
-	for (size_t i = 0; i < config.tasks.len; i++) {
-		struct task *old_task = &config.tasks.entries[i];
+	for (size_t i = 0; i < cur->tasks.len; i++) {
+		struct task *old_task = &cur->tasks.entries[i];
+		struct taskinfo *old_info = &cur->tasks.info[old_task->id];
 		bool found = false;
 
 		for (size_t j = 0; j < cfg.tasks.len; j++) {
 			struct task *new_task = &cfg.tasks.entries[j];
+			struct taskinfo *new_info = &cfg.tasks.info[new_task->id];
 
-			if (strcmp(old_task->name, new_task->name) == 0) {
+			if (strcmp(old_info->name, new_info->name) == 0) {
+				// The pid of a process, the job id of a plugin and the
+				// stages of a pipeline can't be swapped, nor can a builtin
+				// complete a process without reaping it, so a running task
+				// that changed kind is kept around as removed instead.
+				if (old_task->state == TASK_STARTED &&
+						(((old_task->flags ^ new_task->flags) & TASK_KIND) ||
+						 old_info->stages_len != new_info->stages_len)) {
+					break;
+				}
 				new_task->state = old_task->state;
+				new_task->flags |= old_task->flags & TASK_FAILED;
 				new_task->pid = old_task->pid;
+				new_info->last_start = old_info->last_start;
+				new_info->last_exit = old_info->last_exit;
+				new_info->stats = old_info->stats;
+				// The stages still running and the pump move over
+				for (size_t k = 0; k < new_info->stages_len; k++) {
+					new_info->stages[k].pid = old_info->stages[k].pid;
+				}
+				new_info->pump = old_info->pump;
+				old_info->pump = 0;
 				found = true;
-				log_debug("config: merged task '%s'", new_task->name);
+				log_debug("config: merged task '%s'", new_info->name);
 				break;
 			}
 		}
@@ -356,24 +1253,32 @@ config_load_and_swap(const char *filename)
 		// keep it around until it completes. Mark as temporary so it can then
 		// be collected.
 		if (!found && old_task->state == TASK_STARTED) {
-			struct task task;
+			struct task task = *old_task;
+			struct taskinfo info;
 
-			if (task_clone(&task, old_task) == NULL) {
+			if (task_clone(&info, old_info) == NULL) {
 				log_error("config: failed to clone task:");
 				goto failed;
 			}
 
-			task.temporary = true;
-			if (!tasklist_append(&cfg.tasks, &task)) {
+			task.flags |= TASK_TEMPORARY;
+			if (!tasklist_append(&cfg.tasks, &task, &info)) {
 				log_error("config: failed to append task:");
+				task_deinit(&info);
 				goto failed;
 			}
-			log_debug("config: keeping removed task '%s'", old_task->name);
+			log_debug("config: keeping removed task '%s'", old_info->name);
 		}
 	}
 
-	config_deinit(&config);
-	memcpy(&config, &cfg, sizeof(config));
+	for (size_t i = 0; i < cfg.tasks.len; i++) {
+		if (cfg.tasks.entries[i].state == TASK_STARTED) {
+			cfg.tasks.running++;
+		}
+	}
+
+	config_deinit(cur);
+	memcpy(cur, &cfg, sizeof(*cur));
 
 	log_info("config: loaded %s", filename);
 	return true;
@@ -383,15 +1288,45 @@ failed:
 	return false;
 }
 
-void
-config_deinit(struct config *cfg)
+// Loads filename and replaces *cur with it.
+bool
+config_reload(struct config *cur, const char *filename)
 {
-	if (cfg->tasks.entries != NULL) {
-		for (size_t i = 0; i < cfg->tasks.len; i++) {
-			task_deinit(&cfg->tasks.entries[i]);
-		}
-		free(cfg->tasks.entries);
+	struct config cfg;
+
+	if (!config_load(filename, &cfg)) {
+		return false;
+	}
+	return config_merge(cur, cfg, filename);
+}
+
+// Reloads the config of a user's session from f, which the caller has
+// opened and checked, see config_parse().
+bool
+config_reload_user(struct config *cur, FILE *f, const char *filename)
+{
+	struct config cfg;
+
+	if (!config_parse(f, &cfg, true)) {
+		return false;
 	}
+	return config_merge(cur, cfg, filename);
+}
+
+bool
+config_load_and_swap(const char *filename)
+{
+	return config_reload(&config, filename);
+}
 
+void
+config_deinit(struct config *cfg)
+{
+	tasklist_deinit(&cfg->tasks);
+	free(cfg->displays);
+	free(cfg->history);
+	free(cfg->runs);
+	free(cfg->socket);
+	free(cfg->power_root);
 }
 
@@ -0,0 +1,502 @@
+// accept4()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "idlemon.h"
+#include "idlemon-events.h"
+
+// Most descriptors handled per events_handle()
+#define EVENTS_BATCH 64
+
+struct subscriber {
+	int fd;
+	uint32_t events;
+	uint32_t thresholds_len;
+	uint64_t thresholds[IDLEMON_EVENTS_MAX_THRESHOLDS];
+};
+
+static char *path = NULL;
+static int listen_fd = -1;
+static int epoll_fd = -1;
+// Whether listen_fd is in the epoll set, it's taken out while we're out of
+// descriptors so pending connections don't keep waking us
+static bool accepting = false;
+
+static struct subscriber *subs = NULL;
+static size_t subs_len = 0;
+static size_t subs_cap = 0;
+
+// Distinct thresholds of all subscribers in ascending order with the number of
+// subscribers asking for each, so a tick that crosses none costs a search
+static uint64_t *thresholds = NULL;
+static uint32_t *thresholds_refs = NULL;
+static size_t thresholds_len = 0;
+static size_t thresholds_cap = 0;
+// IDLEMON_EVENTS_* flags any subscriber asked for
+static uint32_t interest = 0;
+
+// State as of the last events_update(), for the reply to a subscription
+static uint64_t last_idle = 0;
+static bool last_xss_active = false;
+
+
+// Index of the first threshold larger than t.
+static size_t
+threshold_after(uint64_t t)
+{
+	size_t lo = 0;
+	size_t hi = thresholds_len;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (thresholds[mid] <= t) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static bool
+threshold_ref(uint64_t t)
+{
+	size_t i = threshold_after(t);
+
+	if (i > 0 && thresholds[i - 1] == t) {
+		thresholds_refs[i - 1]++;
+		return true;
+	}
+
+	if (thresholds_len >= thresholds_cap) {
+		size_t cap = thresholds_cap == 0 ? 16 : thresholds_cap * 2;
+		uint64_t *ts = realloc(thresholds, cap * sizeof(*ts));
+		uint32_t *refs;
+
+		if (ts == NULL) {
+			log_error("events: realloc failed:");
+			return false;
+		}
+		thresholds = ts;
+		if ((refs = realloc(thresholds_refs, cap * sizeof(*refs))) == NULL) {
+			log_error("events: realloc failed:");
+			return false;
+		}
+		thresholds_refs = refs;
+		thresholds_cap = cap;
+	}
+	memmove(&thresholds[i + 1], &thresholds[i], (thresholds_len - i) * sizeof(*thresholds));
+	memmove(&thresholds_refs[i + 1], &thresholds_refs[i],
+			(thresholds_len - i) * sizeof(*thresholds_refs));
+	thresholds[i] = t;
+	thresholds_refs[i] = 1;
+	thresholds_len++;
+	return true;
+}
+
+static void
+threshold_unref(uint64_t t)
+{
+	size_t i = threshold_after(t);
+
+	if (i == 0 || thresholds[i - 1] != t || --thresholds_refs[i - 1] > 0) {
+		return;
+	}
+	i--;
+	thresholds_len--;
+	memmove(&thresholds[i], &thresholds[i + 1], (thresholds_len - i) * sizeof(*thresholds));
+	memmove(&thresholds_refs[i], &thresholds_refs[i + 1],
+			(thresholds_len - i) * sizeof(*thresholds_refs));
+}
+
+static void
+update_interest(void)
+{
+	interest = 0;
+	for (size_t i = 0; i < subs_len; i++) {
+		interest |= subs[i].events;
+	}
+}
+
+static void
+unsubscribe(struct subscriber *s)
+{
+	for (uint32_t i = 0; i < s->thresholds_len; i++) {
+		threshold_unref(s->thresholds[i]);
+	}
+	s->thresholds_len = 0;
+	s->events = 0;
+}
+
+// Disconnects the subscriber at i, moving the last one into its place.
+static void
+drop(size_t i)
+{
+	struct subscriber *s = &subs[i];
+	uint32_t events = s->events;
+
+	unsubscribe(s);
+	close(s->fd);
+	subs[i] = subs[--subs_len];
+	if (events != 0) {
+		update_interest();
+	}
+
+	if (!accepting && listen_fd != -1) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = listen_fd };
+
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == 0) {
+			accepting = true;
+		}
+	}
+}
+
+// Sends ev to the subscriber at i without blocking. Returns false if it had
+// to be dropped, subs[i] is then another subscriber.
+static bool
+send_event(size_t i, const struct idlemon_event *ev)
+{
+	if (send(subs[i].fd, ev, sizeof(*ev), MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(*ev)) {
+		return true;
+	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		log_warn("events: dropping subscriber %d, it isn't keeping up", subs[i].fd);
+	} else if (errno != EPIPE && errno != ECONNRESET) {
+		log_warn("events: dropping subscriber %d:", subs[i].fd);
+	}
+	drop(i);
+	return false;
+}
+
+// Sends ev to every subscriber asking for events of type flag.
+static void
+fan_out(uint32_t flag, const struct idlemon_event *ev)
+{
+	if (!(interest & flag)) {
+		return;
+	}
+	for (size_t i = 0; i < subs_len;) {
+		if (!(subs[i].events & flag) || send_event(i, ev)) {
+			i++;
+		}
+	}
+}
+
+static void
+event_init(struct idlemon_event *ev, enum idlemon_event_type type)
+{
+	memset(ev, 0, sizeof(*ev));
+	ev->type = type;
+	ev->time = time(NULL);
+	ev->idle = last_idle;
+	ev->xss_active = last_xss_active;
+}
+
+// Replaces what the subscriber at i is subscribed to and sends it the current
+// state. Returns false if it had to be dropped.
+static bool
+subscribe(size_t i, const struct idlemon_events_subscribe *req)
+{
+	struct subscriber *s = &subs[i];
+	struct idlemon_event ev;
+	uint32_t events = s->events;
+
+	unsubscribe(s);
+	for (uint32_t j = 0; j < req->thresholds_len; j++) {
+		if (!threshold_ref(req->thresholds[j])) {
+			break;
+		}
+		s->thresholds[s->thresholds_len++] = req->thresholds[j];
+	}
+	s->events = req->events;
+	if (s->events != events) {
+		update_interest();
+	}
+	log_debug("events: subscriber %d subscribed to %#x with %u thresholds",
+			s->fd, (unsigned)s->events, (unsigned)s->thresholds_len);
+
+	event_init(&ev, IDLEMON_EVENT_STATE);
+	return send_event(i, &ev);
+}
+
+// Reads the subscriptions sent by the subscriber at i. Returns false if it
+// was dropped.
+static bool
+receive(size_t i)
+{
+	for (;;) {
+		struct idlemon_events_subscribe req;
+		ssize_t n = recv(subs[i].fd, &req, sizeof(req), MSG_DONTWAIT);
+
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		}
+		if (n <= 0) {
+			log_debug("events: subscriber %d disconnected", subs[i].fd);
+			drop(i);
+			return false;
+		}
+		if (n != sizeof(req) || req.version != IDLEMON_EVENTS_VERSION ||
+				req.thresholds_len > IDLEMON_EVENTS_MAX_THRESHOLDS) {
+			log_warn("events: dropping subscriber %d, invalid subscription", subs[i].fd);
+			drop(i);
+			return false;
+		}
+		if (!subscribe(i, &req)) {
+			return false;
+		}
+	}
+}
+
+static void
+accept_all(void)
+{
+	for (;;) {
+		struct epoll_event ev = { .events = EPOLLIN };
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (fd == -1) {
+			if (errno == EMFILE || errno == ENFILE) {
+				// Wait for a subscriber to go rather than spinning on
+				// the pending connection
+				log_warn("events: not accepting subscribers:");
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, NULL);
+				accepting = false;
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				log_warn("events: accept failed:");
+			}
+			return;
+		}
+
+		if (subs_len >= subs_cap) {
+			size_t cap = subs_cap == 0 ? 16 : subs_cap * 2;
+			struct subscriber *ss = realloc(subs, cap * sizeof(*ss));
+
+			if (ss == NULL) {
+				log_error("events: realloc failed:");
+				close(fd);
+				return;
+			}
+			subs = ss;
+			subs_cap = cap;
+		}
+
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			log_error("events: epoll_ctl failed:");
+			close(fd);
+			return;
+		}
+		subs[subs_len++] = (struct subscriber){ .fd = fd };
+		log_debug("events: subscriber %d connected", fd);
+	}
+}
+
+static char *
+default_path(void)
+{
+	char buf[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+	char *env = getenv("XDG_RUNTIME_DIR");
+	int r;
+
+	if (env == NULL) {
+		log_error("events: XDG_RUNTIME_DIR not set");
+		return NULL;
+	}
+	r = snprintf(buf, sizeof(buf), "%s/%s", env, IDLEMON_EVENTS_NAME);
+	if (r < 0 || (size_t)r >= sizeof(buf)) {
+		log_error("events: path overflow");
+		return NULL;
+	}
+	return strdup(buf);
+}
+
+bool
+events_init(const char *filename)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct epoll_event ev = { .events = EPOLLIN };
+
+	if ((path = filename != NULL ? strdup(filename) : default_path()) == NULL) {
+		return false;
+	}
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		log_error("events: path overflow");
+		goto failed;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		log_error("events: socket failed:");
+		goto failed;
+	}
+	// Only a single instance runs, so an existing socket is left over from
+	// one that didn't exit cleanly
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		log_error("events: failed to bind %s:", path);
+		goto failed;
+	}
+	if (listen(listen_fd, SOMAXCONN) == -1) {
+		log_error("events: failed to listen on %s:", path);
+		goto failed;
+	}
+
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		log_error("events: epoll_create1 failed:");
+		goto failed;
+	}
+	ev.data.fd = listen_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+		log_error("events: epoll_ctl failed:");
+		goto failed;
+	}
+	accepting = true;
+
+	log_debug("events: listening on %s", path);
+	return true;
+
+failed:
+	events_deinit();
+	return false;
+}
+
+void
+events_deinit(void)
+{
+	for (size_t i = 0; i < subs_len; i++) {
+		close(subs[i].fd);
+	}
+	if (listen_fd != -1) {
+		close(listen_fd);
+		unlink(path);
+		listen_fd = -1;
+	}
+	if (epoll_fd != -1) {
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+	free(subs);
+	free(thresholds);
+	free(thresholds_refs);
+	free(path);
+	subs = NULL;
+	subs_len = subs_cap = 0;
+	thresholds = NULL;
+	thresholds_refs = NULL;
+	thresholds_len = thresholds_cap = 0;
+	interest = 0;
+	accepting = false;
+	path = NULL;
+}
+
+// A descriptor that's readable while a connection or subscription is pending,
+// -1 if not listening.
+int
+events_fd(void)
+{
+	return epoll_fd;
+}
+
+void
+events_handle(void)
+{
+	struct epoll_event evs[EVENTS_BATCH];
+	int n = epoll_wait(epoll_fd, evs, EVENTS_BATCH, 0);
+
+	for (int i = 0; i < n; i++) {
+		int fd = evs[i].data.fd;
+
+		if (fd == listen_fd) {
+			accept_all();
+			continue;
+		}
+		// Only subscriptions and hangups get here, which are rare enough
+		// for a scan
+		for (size_t j = 0; j < subs_len; j++) {
+			if (subs[j].fd == fd) {
+				receive(j);
+				break;
+			}
+		}
+	}
+}
+
+// Pushes the changes between the aggregate states of the last two ticks.
+void
+events_update(const struct state *state, const struct state *prev_state)
+{
+	struct idlemon_event ev;
+
+	last_idle = state->idle;
+	last_xss_active = state->xss_active;
+
+	if (subs_len == 0) {
+		return;
+	}
+
+	// Only when activity first ends the idle period, not on every tick of
+	// input that follows
+	if (state->sustained && !prev_state->sustained) {
+		event_init(&ev, IDLEMON_EVENT_ACTIVE);
+		fan_out(IDLEMON_EVENTS_ACTIVE, &ev);
+	}
+	if (state->xss_active != prev_state->xss_active) {
+		event_init(&ev, IDLEMON_EVENT_XSS);
+		fan_out(IDLEMON_EVENTS_XSS, &ev);
+	}
+
+	if (!(interest & IDLEMON_EVENTS_IDLE) || state->idle <= prev_state->idle) {
+		return;
+	}
+	// Every threshold in (prev_state->idle, state->idle] was reached. A
+	// dropped subscriber can take thresholds with it and shift the rest,
+	// so the next one is looked up from the last one sent.
+	for (size_t t = threshold_after(prev_state->idle);
+			t < thresholds_len && thresholds[t] <= state->idle;
+			t = threshold_after(ev.threshold)) {
+		event_init(&ev, IDLEMON_EVENT_IDLE);
+		ev.threshold = thresholds[t];
+
+		for (size_t i = 0; i < subs_len;) {
+			const struct subscriber *s = &subs[i];
+			bool match = false;
+
+			if (s->events & IDLEMON_EVENTS_IDLE) {
+				for (uint32_t j = 0; j < s->thresholds_len && !match; j++) {
+					match = s->thresholds[j] == ev.threshold;
+				}
+			}
+			if (!match || send_event(i, &ev)) {
+				i++;
+			}
+		}
+	}
+}
+
+// Pushes a change in the state of a task.
+void
+events_task(const struct task *task, const struct taskinfo *info)
+{
+	struct idlemon_event ev;
+
+	if (!(interest & IDLEMON_EVENTS_TASK)) {
+		return;
+	}
+	event_init(&ev, IDLEMON_EVENT_TASK);
+	ev.task_state = task->state;
+	ev.task_flags = (task->flags & TASK_FAILED ? IDLEMON_STATUS_FAILED : 0) |
+		(task->flags & TASK_TEMPORARY ? IDLEMON_STATUS_TEMPORARY : 0);
+	strncpy(ev.task, info->name, sizeof(ev.task) - 1);
+	fan_out(IDLEMON_EVENTS_TASK, &ev);
+}
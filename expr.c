@@ -0,0 +1,473 @@
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "idlemon.h"
+
+// Deepest evaluation stack an expression may need
+#define EXPR_STACK 32
+
+// expr_compile() rejects expressions deeper than the stack, this only
+// catches an opcode emit() doesn't count as a push
+#define PUSH(v) (assert(n < EXPR_STACK), stack[n++] = (v))
+
+enum op {
+	OP_NUM,
+	// Variables each have their own op to save a second dispatch
+	OP_IDLE,
+	OP_XSS,
+	OP_LOAD1,
+	OP_LOAD5,
+	OP_LOAD15,
+	OP_AC,
+	OP_BATTERY,
+	OP_BATTERY_PCT,
+	OP_LID_CLOSED,
+	OP_NOT,
+	OP_AND,
+	OP_OR,
+	OP_LT,
+	OP_LE,
+	OP_GT,
+	OP_GE,
+	OP_EQ,
+	OP_NE,
+};
+
+struct instr {
+	uint8_t op;
+	double num;
+};
+
+// Compiled to postfix code run on a small stack. The result is cached along
+// with the inputs it was computed from, so it's only run again when one of
+// the inputs the expression refers to has changed.
+struct expr {
+	uint8_t inputs;
+	bool cached;
+	bool value;
+	uint16_t len;
+	struct state seen;
+	struct instr code[];
+};
+
+static const struct {
+	const char *name;
+	enum op op;
+	uint8_t input;
+} vars[] = {
+	{ "idle", OP_IDLE, EXPR_IDLE },
+	{ "xss", OP_XSS, EXPR_XSS },
+	{ "load1", OP_LOAD1, EXPR_LOAD },
+	{ "load5", OP_LOAD5, EXPR_LOAD },
+	{ "load15", OP_LOAD15, EXPR_LOAD },
+	{ "ac", OP_AC, EXPR_POWER },
+	{ "battery", OP_BATTERY, EXPR_POWER },
+	{ "battery_pct", OP_BATTERY_PCT, EXPR_POWER },
+	{ "lid_closed", OP_LID_CLOSED, EXPR_LID },
+};
+
+struct parser {
+	const char *src;
+	const char *s;
+	struct instr *code;
+	size_t len;
+	size_t cap;
+	size_t depth;
+	size_t max_depth;
+	size_t nesting;
+	uint8_t inputs;
+	char *err;
+	size_t err_len;
+	bool failed;
+};
+
+
+__attribute__((format(printf, 2, 3)))
+static void
+parse_error(struct parser *p, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (p->failed) {
+		return;
+	}
+	p->failed = true;
+
+	n = snprintf(p->err, p->err_len, "column %zu: ", (size_t)(p->s - p->src) + 1);
+	if (n >= 0 && (size_t)n < p->err_len) {
+		va_start(ap, fmt);
+		vsnprintf(p->err + n, p->err_len - n, fmt, ap);
+		va_end(ap);
+	}
+}
+
+// Appends an instruction, tracking how deep the stack gets at run time.
+static void
+emit(struct parser *p, enum op op, double num)
+{
+	if (p->failed) {
+		return;
+	}
+	if (p->len >= p->cap) {
+		size_t cap = p->cap == 0 ? 8 : p->cap * 2;
+		struct instr *code = realloc(p->code, cap * sizeof(*code));
+
+		if (code == NULL) {
+			parse_error(p, "out of memory");
+			return;
+		}
+		p->code = code;
+		p->cap = cap;
+	}
+	p->code[p->len++] = (struct instr){ .op = op, .num = num };
+
+	switch (op) {
+	case OP_NUM:
+	case OP_IDLE:
+	case OP_XSS:
+	case OP_LOAD1:
+	case OP_LOAD5:
+	case OP_LOAD15:
+	case OP_AC:
+	case OP_BATTERY:
+	case OP_BATTERY_PCT:
+	case OP_LID_CLOSED:
+		if (++p->depth > p->max_depth) {
+			p->max_depth = p->depth;
+		}
+		break;
+	case OP_NOT:
+		break;
+	default:
+		p->depth--;
+		break;
+	}
+}
+
+static void
+skip_space(struct parser *p)
+{
+	while (isspace((unsigned char)*p->s)) {
+		p->s++;
+	}
+}
+
+static bool
+accept(struct parser *p, const char *tok)
+{
+	size_t len = strlen(tok);
+
+	skip_space(p);
+	if (strncmp(p->s, tok, len) != 0) {
+		return false;
+	}
+	p->s += len;
+	return true;
+}
+
+static void parse_or(struct parser *p);
+
+static void
+parse_number(struct parser *p)
+{
+	char *end;
+	double n;
+
+	errno = 0;
+	n = strtod(p->s, &end);
+	if (errno != 0 || end == p->s) {
+		parse_error(p, "invalid number");
+		return;
+	}
+	p->s = end;
+
+	// Durations are in milliseconds like idle
+	switch (*p->s) {
+	case 's': n *= 1000; p->s++; break;
+	case 'm': n *= 1000 * 60; p->s++; break;
+	case 'h': n *= 1000 * 60 * 60; p->s++; break;
+	case 'd': n *= 1000 * 60 * 60 * 24; p->s++; break;
+	case 'w': n *= 1000 * 60 * 60 * 24 * 7; p->s++; break;
+	}
+	if (isalnum((unsigned char)*p->s)) {
+		parse_error(p, "invalid unit '%c'", *p->s);
+		return;
+	}
+	emit(p, OP_NUM, n);
+}
+
+static void
+parse_primary(struct parser *p)
+{
+	const char *start;
+	size_t len;
+
+	skip_space(p);
+
+	if (accept(p, "(")) {
+		if (++p->nesting > EXPR_STACK) {
+			parse_error(p, "expression too complex");
+			return;
+		}
+		parse_or(p);
+		if (!accept(p, ")")) {
+			parse_error(p, "expected ')'");
+		}
+		p->nesting--;
+		return;
+	}
+	if (isdigit((unsigned char)*p->s) || *p->s == '.') {
+		parse_number(p);
+		return;
+	}
+	if (*p->s == '\0') {
+		parse_error(p, "unexpected end");
+		return;
+	}
+	if (!isalpha((unsigned char)*p->s)) {
+		parse_error(p, "unexpected '%c'", *p->s);
+		return;
+	}
+
+	start = p->s;
+	while (isalnum((unsigned char)*p->s) || *p->s == '_') {
+		p->s++;
+	}
+	len = p->s - start;
+
+	if (len == 4 && strncmp(start, "true", len) == 0) {
+		emit(p, OP_NUM, 1);
+		return;
+	}
+	if (len == 5 && strncmp(start, "false", len) == 0) {
+		emit(p, OP_NUM, 0);
+		return;
+	}
+	for (size_t i = 0; i < sizeof(vars) / sizeof(*vars); i++) {
+		if (strlen(vars[i].name) == len && strncmp(start, vars[i].name, len) == 0) {
+			p->inputs |= vars[i].input;
+			emit(p, vars[i].op, 0);
+			return;
+		}
+	}
+
+	p->s = start;
+	parse_error(p, "unknown variable '%.*s'", (int)len, start);
+}
+
+static void
+parse_compare(struct parser *p)
+{
+	static const struct {
+		const char *tok;
+		enum op op;
+	} ops[] = {
+		// Longest first so "<=" isn't taken for "<"
+		{ "<=", OP_LE }, { ">=", OP_GE }, { "==", OP_EQ }, { "!=", OP_NE },
+		{ "<", OP_LT }, { ">", OP_GT },
+	};
+
+	parse_primary(p);
+
+	for (size_t i = 0; i < sizeof(ops) / sizeof(*ops); i++) {
+		if (accept(p, ops[i].tok)) {
+			parse_primary(p);
+			emit(p, ops[i].op, 0);
+			return;
+		}
+	}
+}
+
+static void
+parse_unary(struct parser *p)
+{
+	skip_space(p);
+	// Not to be confused with "!="
+	if (*p->s == '!' && p->s[1] != '=') {
+		p->s++;
+		if (++p->nesting > EXPR_STACK) {
+			parse_error(p, "expression too complex");
+			return;
+		}
+		parse_unary(p);
+		p->nesting--;
+		emit(p, OP_NOT, 0);
+		return;
+	}
+	parse_compare(p);
+}
+
+static void
+parse_and(struct parser *p)
+{
+	parse_unary(p);
+	while (!p->failed && accept(p, "&&")) {
+		parse_unary(p);
+		emit(p, OP_AND, 0);
+	}
+}
+
+static void
+parse_or(struct parser *p)
+{
+	parse_and(p);
+	while (!p->failed && accept(p, "||")) {
+		parse_and(p);
+		emit(p, OP_OR, 0);
+	}
+}
+
+// Compiles an expression such as "idle > 10m && load1 < 2". On failure NULL
+// is returned and err describes the problem.
+struct expr *
+expr_compile(const char *s, char *err, size_t err_len)
+{
+	struct parser p = {
+		.src = s,
+		.s = s,
+		.err = err,
+		.err_len = err_len,
+	};
+	struct expr *e = NULL;
+
+	parse_or(&p);
+	skip_space(&p);
+	if (!p.failed && *p.s != '\0') {
+		parse_error(&p, "unexpected '%c'", *p.s);
+	}
+	if (!p.failed && p.max_depth > EXPR_STACK) {
+		parse_error(&p, "expression too complex");
+	}
+	if (!p.failed && p.len > UINT16_MAX) {
+		parse_error(&p, "expression too long");
+	}
+
+	if (!p.failed) {
+		if ((e = malloc(sizeof(*e) + p.len * sizeof(*e->code))) == NULL) {
+			snprintf(err, err_len, "out of memory");
+		} else {
+			memset(e, 0, sizeof(*e));
+			e->inputs = p.inputs;
+			e->len = p.len;
+			memcpy(e->code, p.code, p.len * sizeof(*e->code));
+		}
+	}
+
+	free(p.code);
+	return e;
+}
+
+struct expr *
+expr_dup(const struct expr *e)
+{
+	size_t size = sizeof(*e) + e->len * sizeof(*e->code);
+	struct expr *dup;
+
+	if ((dup = malloc(size)) != NULL) {
+		memcpy(dup, e, size);
+	}
+	return dup;
+}
+
+uint8_t
+expr_inputs(const struct expr *e)
+{
+	return e->inputs;
+}
+
+static bool
+inputs_changed(const struct expr *e, const struct state *state)
+{
+	return ((e->inputs & EXPR_IDLE) && state->idle != e->seen.idle) ||
+		((e->inputs & EXPR_XSS) && state->xss_active != e->seen.xss_active) ||
+		((e->inputs & EXPR_LOAD) && memcmp(state->load, e->seen.load, sizeof(state->load)) != 0) ||
+		((e->inputs & EXPR_POWER) && (state->power != e->seen.power ||
+			state->battery != e->seen.battery)) ||
+		((e->inputs & EXPR_LID) && state->power != e->seen.power);
+}
+
+bool
+expr_eval(struct expr *e, const struct state *state)
+{
+	double stack[EXPR_STACK];
+	size_t n = 0;
+
+	if (e->cached && !inputs_changed(e, state)) {
+		return e->value;
+	}
+
+	for (const struct instr *i = e->code; i < e->code + e->len; i++) {
+		switch (i->op) {
+		case OP_NUM:         PUSH(i->num); break;
+		case OP_IDLE:        PUSH(state->idle); break;
+		case OP_XSS:         PUSH(state->xss_active); break;
+		case OP_LOAD1:       PUSH(state->load[0]); break;
+		case OP_LOAD5:       PUSH(state->load[1]); break;
+		case OP_LOAD15:      PUSH(state->load[2]); break;
+		case OP_AC:          PUSH((state->power & POWER_AC) != 0); break;
+		case OP_BATTERY:     PUSH((state->power & POWER_BATTERY) != 0); break;
+		case OP_BATTERY_PCT: PUSH(state->battery); break;
+		case OP_LID_CLOSED:  PUSH((state->power & POWER_LID_CLOSED) != 0); break;
+		case OP_NOT:
+			stack[n - 1] = stack[n - 1] == 0;
+			break;
+		case OP_AND: n--; stack[n - 1] = stack[n - 1] != 0 && stack[n] != 0; break;
+		case OP_OR:  n--; stack[n - 1] = stack[n - 1] != 0 || stack[n] != 0; break;
+		case OP_LT:  n--; stack[n - 1] = stack[n - 1] < stack[n]; break;
+		case OP_LE:  n--; stack[n - 1] = stack[n - 1] <= stack[n]; break;
+		case OP_GT:  n--; stack[n - 1] = stack[n - 1] > stack[n]; break;
+		case OP_GE:  n--; stack[n - 1] = stack[n - 1] >= stack[n]; break;
+		case OP_EQ:  n--; stack[n - 1] = stack[n - 1] == stack[n]; break;
+		case OP_NE:  n--; stack[n - 1] = stack[n - 1] != stack[n]; break;
+		}
+	}
+
+	e->seen = *state;
+	e->value = stack[0] != 0;
+	e->cached = true;
+	return e->value;
+}
+
+// Reads the load averages, only done when some expression refers to them.
+bool
+expr_load(double load[3])
+{
+	char buf[128];
+	char *s = buf;
+	ssize_t n;
+	int fd;
+
+	// Read directly, fopen() would allocate on every tick
+	if ((fd = open("/proc/loadavg", O_RDONLY | O_CLOEXEC)) == -1) {
+		log_error("expr: failed to open /proc/loadavg:");
+		return false;
+	}
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0) {
+		log_error("expr: failed to read /proc/loadavg:");
+		return false;
+	}
+	buf[n] = '\0';
+
+	for (int i = 0; i < 3; i++) {
+		char *end;
+
+		load[i] = strtod(s, &end);
+		if (end == s) {
+			log_error("expr: failed to parse /proc/loadavg");
+			return false;
+		}
+		s = end;
+	}
+	return true;
+}
@@ -0,0 +1,310 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "idlemon.h"
+
+#define HISTORY_MAGIC 0x48444c49u
+#define HISTORY_VERSION 1
+// Number of idle periods kept, older ones are overwritten
+#define HISTORY_CAP 8192
+// Shorter idle periods aren't worth remembering
+#define HISTORY_MIN_IDLE 60
+
+// Idle lengths are bucketed by when the period started (weekday and hour)
+// into BIN_WIDTH second bins, the last bin holding anything longer.
+#define BIN_WIDTH (5 * 60)
+#define BINS 49
+// Fewer samples than this and we don't dare to predict
+#define MIN_SAMPLES 5
+
+struct record {
+	// Unix time in seconds the idle period started
+	int64_t start;
+	// Length in seconds
+	uint32_t length;
+	uint32_t reserved;
+};
+
+struct history_file {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t cap;
+	uint32_t reserved;
+	// Total number of records ever written, the next one goes to
+	// records[head % cap]
+	uint64_t head;
+	struct record records[HISTORY_CAP];
+};
+
+static struct history_file *file = NULL;
+static uint32_t bins[7][24][BINS];
+
+
+static unsigned
+length_bin(unsigned long seconds)
+{
+	unsigned long bin = seconds / BIN_WIDTH;
+	return bin < BINS - 1 ? bin : BINS - 1;
+}
+
+static uint32_t *
+bucket(time_t start)
+{
+	struct tm tm;
+
+	if (localtime_r(&start, &tm) == NULL) {
+		return NULL;
+	}
+	return bins[tm.tm_wday][tm.tm_hour];
+}
+
+static void
+add_record(const struct record *r)
+{
+	uint32_t *b = bucket(r->start);
+
+	if (b != NULL) {
+		b[length_bin(r->length)]++;
+	}
+}
+
+static void
+remove_record(const struct record *r)
+{
+	uint32_t *b = bucket(r->start);
+
+	if (b != NULL && b[length_bin(r->length)] > 0) {
+		b[length_bin(r->length)]--;
+	}
+}
+
+static struct history_file *
+history_map(const char *filename, bool writable)
+{
+	struct history_file *f;
+	struct stat st;
+	int fd;
+
+	if ((fd = open(filename, (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0600)) == -1) {
+		log_error("history: failed to open %s:", filename);
+		return NULL;
+	}
+	if (fstat(fd, &st) == -1) {
+		log_error("history: failed to stat %s:", filename);
+		close(fd);
+		return NULL;
+	}
+	if ((size_t)st.st_size != sizeof(*f)) {
+		if (!writable) {
+			log_error("history: invalid file %s", filename);
+			close(fd);
+			return NULL;
+		}
+		if (ftruncate(fd, sizeof(*f)) == -1) {
+			log_error("history: failed to resize %s:", filename);
+			close(fd);
+			return NULL;
+		}
+	}
+
+	f = mmap(NULL, sizeof(*f), writable ? PROT_READ | PROT_WRITE : PROT_READ,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (f == MAP_FAILED) {
+		log_error("history: mmap failed:");
+		return NULL;
+	}
+
+	if (f->magic != HISTORY_MAGIC || f->version != HISTORY_VERSION || f->cap != HISTORY_CAP) {
+		if (!writable) {
+			log_error("history: invalid file %s", filename);
+			munmap(f, sizeof(*f));
+			return NULL;
+		}
+		if (f->magic != 0) {
+			log_warn("history: discarding incompatible %s", filename);
+		}
+		memset(f, 0, sizeof(*f));
+		f->version = HISTORY_VERSION;
+		f->cap = HISTORY_CAP;
+		f->magic = HISTORY_MAGIC;
+	}
+	return f;
+}
+
+static void
+history_load(const struct history_file *f)
+{
+	uint64_t n = f->head < HISTORY_CAP ? f->head : HISTORY_CAP;
+
+	memset(bins, 0, sizeof(bins));
+	for (uint64_t i = f->head - n; i < f->head; i++) {
+		add_record(&f->records[i % HISTORY_CAP]);
+	}
+}
+
+bool
+history_init(const char *filename)
+{
+	char *path = filename != NULL ? strdup(filename) : state_filename("history");
+
+	if (path == NULL) {
+		return false;
+	}
+
+	if (mkdir_parents(path)) {
+		file = history_map(path, true);
+	}
+	if (file != NULL) {
+		history_load(file);
+		log_debug("history: loaded %llu idle periods from %s",
+				(unsigned long long)(file->head < HISTORY_CAP ? file->head : HISTORY_CAP),
+				path);
+	}
+
+	free(path);
+	return file != NULL;
+}
+
+void
+history_deinit(void)
+{
+	if (file != NULL) {
+		munmap(file, sizeof(*file));
+		file = NULL;
+	}
+}
+
+void
+history_update(const struct state *state, const struct state *prev_state)
+{
+	struct record *r;
+	unsigned long length;
+
+	// An idle period ends as soon as there's activity
+	if (file == NULL || state->idle >= prev_state->idle) {
+		return;
+	}
+	if ((length = prev_state->idle / 1000) < HISTORY_MIN_IDLE) {
+		return;
+	}
+
+	r = &file->records[file->head % HISTORY_CAP];
+	if (file->head >= HISTORY_CAP) {
+		// The oldest record is about to be overwritten so forget it first
+		remove_record(r);
+	}
+
+	r->start = time(NULL) - (time_t)length;
+	r->length = length > UINT32_MAX ? UINT32_MAX : length;
+	add_record(r);
+	__atomic_store_n(&file->head, file->head + 1, __ATOMIC_RELEASE);
+
+	log_debug("history: recorded idle period of %lus", length);
+}
+
+bool
+history_expect(unsigned long idle, unsigned long expected)
+{
+	uint32_t *b;
+	uint64_t total = 0, enough = 0;
+	unsigned from, to;
+
+	if (file == NULL) {
+		return true;
+	}
+	if ((b = bucket(time(NULL) - (time_t)(idle / 1000))) == NULL) {
+		return true;
+	}
+
+	// Of the past idle periods that lasted at least as long as the current
+	// one, how many went on for the expected time on top?
+	from = length_bin(idle / 1000);
+	to = length_bin((idle + expected) / 1000);
+	for (unsigned i = from; i < BINS; i++) {
+		total += b[i];
+		if (i >= to) {
+			enough += b[i];
+		}
+	}
+
+	if (total < MIN_SAMPLES) {
+		return true;
+	}
+	return enough * 2 >= total;
+}
+
+// Formats the upper bound of a bin.
+static void
+format_length(char *buf, size_t len, unsigned bin)
+{
+	unsigned long m = (unsigned long)(bin + 1) * BIN_WIDTH / 60;
+
+	if (bin == BINS - 1) {
+		// Anything longer, from the bound of the bin before it
+		snprintf(buf, len, ">=%uh", (BINS - 1) * BIN_WIDTH / 3600);
+	} else if (m >= 60) {
+		snprintf(buf, len, "<%luh%02lum", m / 60, m % 60);
+	} else {
+		snprintf(buf, len, "<%lum", m);
+	}
+}
+
+int
+history_print(const char *filename)
+{
+	static const char *days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+	char *path = filename != NULL ? strdup(filename) : state_filename("history");
+
+	if (path == NULL || (file = history_map(path, false)) == NULL) {
+		exit(1);
+	}
+	history_load(file);
+
+	printf("%-3s %-5s %8s %8s %8s\n", "day", "hour", "samples", "median", "p90");
+
+	for (int d = 0; d < 7; d++) {
+		for (int h = 0; h < 24; h++) {
+			const uint32_t *b = bins[d][h];
+			char median[16], p90[16];
+			uint64_t total = 0, sum = 0;
+			int median_bin = -1, p90_bin = -1;
+
+			for (unsigned i = 0; i < BINS; i++) {
+				total += b[i];
+			}
+			if (total == 0) {
+				continue;
+			}
+
+			for (unsigned i = 0; i < BINS; i++) {
+				sum += b[i];
+				if (median_bin == -1 && sum * 2 >= total) {
+					median_bin = i;
+				}
+				if (p90_bin == -1 && sum * 10 >= total * 9) {
+					p90_bin = i;
+				}
+			}
+
+			format_length(median, sizeof(median), median_bin);
+			format_length(p90, sizeof(p90), p90_bin);
+			printf("%-3s %02d:00 %8llu %8s %8s\n", days[d], h,
+					(unsigned long long)total, median, p90);
+		}
+	}
+
+	history_deinit();
+	free(path);
+	return 0;
+}
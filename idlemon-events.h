@@ -0,0 +1,65 @@
+#ifndef IDLEMON_EVENTS_H
+#define IDLEMON_EVENTS_H
+
+// Protocol of the socket idlemon pushes state changes to subscribers on.
+//
+// The socket is a SOCK_SEQPACKET unix socket at $XDG_RUNTIME_DIR/idlemon, or
+// the path in the global 'socket' key. A client connects and sends a struct
+// idlemon_events_subscribe, which it may send again later to change what it's
+// subscribed to. idlemon replies with an IDLEMON_EVENT_STATE snapshot and from
+// then on sends a struct idlemon_event, one per packet, whenever something the
+// client asked for happens. Clients that don't keep up with the events are
+// disconnected.
+
+#include <stdint.h>
+
+#include "idlemon-status.h"
+
+#define IDLEMON_EVENTS_NAME "idlemon"
+#define IDLEMON_EVENTS_VERSION 1
+#define IDLEMON_EVENTS_MAX_THRESHOLDS 8
+
+// Events to subscribe to
+#define IDLEMON_EVENTS_IDLE   (1u << 0)
+#define IDLEMON_EVENTS_ACTIVE (1u << 1)
+#define IDLEMON_EVENTS_XSS    (1u << 2)
+#define IDLEMON_EVENTS_TASK   (1u << 3)
+
+struct idlemon_events_subscribe {
+	uint32_t version;
+	// IDLEMON_EVENTS_* flags
+	uint32_t events;
+	// Idle times in ms to be told about reaching, for IDLEMON_EVENTS_IDLE
+	uint32_t thresholds_len;
+	uint32_t reserved;
+	uint64_t thresholds[IDLEMON_EVENTS_MAX_THRESHOLDS];
+};
+
+enum idlemon_event_type {
+	// Current state, sent in reply to a subscription
+	IDLEMON_EVENT_STATE,
+	// The idle time reached threshold
+	IDLEMON_EVENT_IDLE,
+	// Activity ended the idle period, as it does for tasks, sent once
+	// until the next idle period
+	IDLEMON_EVENT_ACTIVE,
+	// The screensaver was activated or deactivated
+	IDLEMON_EVENT_XSS,
+	// A task started, completed or was reset, task holds its name
+	IDLEMON_EVENT_TASK,
+};
+
+struct idlemon_event {
+	uint32_t type;
+	uint32_t xss_active;
+	// Unix time in seconds of the tick the event happened on
+	int64_t time;
+	uint64_t idle;
+	uint64_t threshold;
+	// An enum idlemon_status_state and IDLEMON_STATUS_* flags
+	uint32_t task_state;
+	uint32_t task_flags;
+	char task[IDLEMON_STATUS_NAME_LEN];
+};
+
+#endif // IDLEMON_EVENTS_H
@@ -0,0 +1,30 @@
+#ifndef IDLEMON_PLUGIN_H
+#define IDLEMON_PLUGIN_H
+
+// Interface of plugins loaded by tasks with the 'plugin' key.
+//
+// A plugin is a shared object exporting IDLEMON_PLUGIN_SYMBOL, a struct
+// idlemon_plugin with version set to IDLEMON_PLUGIN_VERSION. For every run of
+// the task idlemon calls init() and later deinit() on its main thread, and
+// run() in between on one of its worker threads. cancel() is called from the
+// main thread while run() is in progress when the task is reset, run() should
+// then return as soon as it can. Any callback but run() may be NULL.
+
+#include <stdint.h>
+
+#define IDLEMON_PLUGIN_VERSION 1
+#define IDLEMON_PLUGIN_SYMBOL "idlemon_plugin"
+
+struct idlemon_plugin {
+	uint32_t version;
+	// Returns the state passed to the other callbacks, NULL on failure.
+	// argv holds the path of the plugin followed by the arguments from the
+	// 'plugin' key.
+	void *(*init)(char *const *argv);
+	// Returns 0 on success, anything else marks the task as failed
+	int (*run)(void *ctx);
+	void (*cancel)(void *ctx);
+	void (*deinit)(void *ctx);
+};
+
+#endif // IDLEMON_PLUGIN_H
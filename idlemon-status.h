@@ -0,0 +1,102 @@
+#ifndef IDLEMON_STATUS_H
+#define IDLEMON_STATUS_H
+
+// Layout of the live status page idlemon publishes in shared memory.
+//
+// The page is created with shm_open() under the name given by
+// IDLEMON_STATUS_NAME_FMT and the uid of the user running idlemon. Readers
+// map it read only and take a consistent snapshot with
+// idlemon_status_read(), which retries while the daemon is writing.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define IDLEMON_STATUS_NAME_FMT "/idlemon-%u"
+#define IDLEMON_STATUS_MAGIC 0x4d4c4449u
+#define IDLEMON_STATUS_VERSION 3
+#define IDLEMON_STATUS_MAX_TASKS 64
+#define IDLEMON_STATUS_NAME_LEN 48
+
+enum idlemon_status_state {
+	IDLEMON_STATUS_PENDING,
+	IDLEMON_STATUS_STARTED,
+	IDLEMON_STATUS_COMPLETED,
+};
+
+#define IDLEMON_STATUS_FAILED    (1u << 0)
+#define IDLEMON_STATUS_TEMPORARY (1u << 1)
+
+struct idlemon_status_task {
+	char name[IDLEMON_STATUS_NAME_LEN];
+	uint32_t state;
+	uint32_t flags;
+	int32_t pid;
+	// Starts held back by the cooldown or min_interval until activity made
+	// them unnecessary
+	uint32_t avoided;
+	// Unix time in seconds, 0 if never
+	int64_t last_start;
+	int64_t last_exit;
+	// Resources used by the runs since idlemon started. CPU, memory and I/O
+	// only count runs of processes, blocks are 512 bytes.
+	uint64_t runs;
+	uint64_t wall_ms;
+	uint64_t user_us;
+	uint64_t sys_us;
+	uint64_t inblock;
+	uint64_t oublock;
+	uint64_t max_rss_kb;
+	// Duration percentiles over the most recent runs
+	uint32_t p50_ms;
+	uint32_t p99_ms;
+};
+
+struct idlemon_status {
+	uint32_t magic;
+	uint32_t version;
+	// Odd while the daemon is updating the page
+	uint32_t seq;
+	int32_t pid;
+	// Unix time in seconds of the last update
+	int64_t updated;
+	uint64_t idle;
+	uint32_t xss_active;
+	// Number of valid entries in tasks
+	uint32_t tasks_len;
+	// Number of tasks configured, may be larger than tasks_len
+	uint32_t tasks_total;
+	// Runs of activity too short to end an idle period
+	uint32_t suppressed_resets;
+	// Times a display stopped answering or lost its connection
+	uint32_t xss_stalls;
+	uint32_t reserved;
+	struct idlemon_status_task tasks[IDLEMON_STATUS_MAX_TASKS];
+};
+
+// Copies a consistent snapshot of page into out. Returns false if the page
+// isn't a compatible status page.
+static inline bool
+idlemon_status_read(const struct idlemon_status *page, struct idlemon_status *out)
+{
+	uint32_t seq;
+
+	if (page->magic != IDLEMON_STATUS_MAGIC || page->version != IDLEMON_STATUS_VERSION) {
+		return false;
+	}
+
+	for (;;) {
+		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+		memcpy(out, page, sizeof(*out));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+			break;
+		}
+	}
+	return true;
+}
+
+#endif // IDLEMON_STATUS_H
@@ -4,15 +4,53 @@
 #include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
+#include <time.h>
 
 extern bool color_tty;
 
+struct config;
+struct pollfd;
+struct session;
+struct expr;
+struct idlemon_plugin;
+
 #define TASK_DELAY_XSS ULONG_MAX
 
 struct state {
 	unsigned long idle;
 	bool xss_active;
+	// 1, 5 and 15 minute load averages, only read when an expression
+	// refers to them
+	double load[3];
+	// POWER_* flags and the battery charge in percent
+	uint8_t power;
+	uint8_t battery;
+	// Set on ticks with input once activity has lasted long enough to end
+	// the idle period, see activity_update()
+	bool active;
+	bool sustained;
+	// Current run of activity: monotonic time in ms it started and the
+	// number of ticks with input, 0 while idle
+	uint32_t inputs;
+	uint64_t active_since;
+	// Runs of activity too short to end the idle period
+	uint32_t suppressed;
+};
+
+#define POWER_AC         (1 << 0)
+#define POWER_BATTERY    (1 << 1)
+#define POWER_LID_CLOSED (1 << 2)
+
+enum builtin {
+	BUILTIN_NONE,
+	BUILTIN_DPMS,
+	BUILTIN_WRITE,
+	BUILTIN_TOUCH,
+	BUILTIN_SIGNAL,
+	BUILTIN_NOTIFY,
 };
 
 enum taskstate {
@@ -21,27 +59,164 @@ enum taskstate {
 	TASK_COMPLETED,
 };
 
+#define TASK_FAILED    (1 << 0)
+#define TASK_TEMPORARY (1 << 1)
+#define TASK_BUILTIN   (1 << 2)
+// The start or reset condition is an expression rather than the delay
+#define TASK_START_EXPR (1 << 3)
+#define TASK_RESET_EXPR (1 << 4)
+#define TASK_PLUGIN     (1 << 5)
+// A start was held back by the cooldown or min_interval
+#define TASK_HELD       (1 << 6)
+#define TASK_PIPELINE   (1 << 7)
+// How a task runs, when none is set it's a process
+#define TASK_KIND (TASK_BUILTIN | TASK_PLUGIN | TASK_PIPELINE)
+
+// Scheduling state read by task_process() on every tick. It's kept small so
+// scanning the tasklist touches as few cache lines as possible, everything
+// else lives in struct taskinfo.
 struct task {
-	char *name;
-	char **argv;
 	unsigned long delay;
+	// Job id for plugins
+	pid_t pid;
+	// Index of the task's struct taskinfo, stable for the lifetime of the task
+	uint32_t id;
+	uint8_t state;
+	uint8_t flags;
+	// 1-based index into config.displays, 0 to use the aggregate state
+	uint16_t display;
+	// POWER_* flags that must all be set or all be clear to start
+	uint8_t require;
+	uint8_t forbid;
+};
 
-	enum taskstate state;
-	bool temporary;
+// A program in a pipeline, reading the output of the one before
+struct stage {
+	char **argv;
+	// Absolute path of argv[0] and the hash of the PATH it was found with
+	char *path;
+	uint64_t path_hash;
+	// 0 once reaped or before the pipeline starts
 	pid_t pid;
 };
 
+// Durations of this many recent runs are kept for the percentiles
+#define TASK_STATS_RUNS 64
+
+// Resources used by the runs of a task. CPU, memory and I/O are only known
+// for processes, builtins and plugins just count towards runs and durations.
+struct taskstats {
+	uint64_t runs;
+	// Totals over all runs, blocks are 512 bytes
+	uint64_t wall_ms;
+	uint64_t user_us;
+	uint64_t sys_us;
+	uint64_t inblock;
+	uint64_t oublock;
+	// Largest resident set of any run
+	uint64_t max_rss_kb;
+	// Starts held back by the cooldown or min_interval until activity made
+	// them unnecessary
+	uint64_t avoided;
+	// Monotonic time in ns the current run started, 0 if unknown
+	uint64_t started;
+	// Ring of the last TASK_STATS_RUNS durations in ms, with the percentiles
+	// over it updated when a run completes
+	uint32_t durations[TASK_STATS_RUNS];
+	size_t durations_len;
+	size_t durations_next;
+	uint32_t p50_ms;
+	uint32_t p99_ms;
+};
+
+struct taskinfo {
+	char *name;
+	// For builtins argv[0] is the builtin name followed by its arguments
+	char **argv;
+	enum builtin builtin;
+	// Absolute path of argv[0] and the hash of the PATH it was found with
+	char *path;
+	uint64_t path_hash;
+	// Environment for the task or NULL to inherit ours
+	char **envp;
+	char *cwd;
+	// Values of the 'env' and 'env_clear' keys, only used while loading
+	char **env;
+	bool env_clear;
+	// Names from the 'after' key, only set while the config is loading
+	char **after;
+	// Ids of the tasks that must complete successfully first
+	uint32_t *deps;
+	size_t deps_len;
+
+	// Only start if the idle period is likely to last this much longer
+	unsigned long min_expected_idle;
+	// Don't start again until this long after the last run ended
+	unsigned long cooldown;
+	// Don't start again until this long after the last successful run
+	// started, as recorded on disk
+	unsigned long min_interval;
+	// 1-based slot of the task in the run store, 0 until looked up
+	size_t run_slot;
+
+	// Conditions from the 'start' and 'reset' keys
+	struct expr *start;
+	struct expr *reset;
+
+	// For pipelines argv holds every stage separated by "|" and stages
+	// each of them on its own
+	struct stage *stages;
+	size_t stages_len;
+	// File output is appended to and the 1-based stage it's taken from
+	char *capture;
+	size_t capture_stage;
+	// Pump copying the captured stage's output on to the next stage while
+	// running, 0 if none
+	size_t pump;
+
+	// For plugins argv[0] is the path of the shared object
+	const struct idlemon_plugin *plugin;
+	void *plugin_handle;
+
+	// Session the task runs in when monitoring system wide, NULL otherwise
+	const struct session *session;
+
+	time_t last_start;
+	time_t last_exit;
+	struct taskstats stats;
+};
+
 struct tasklist {
+	// Scheduling state in scan order. Entries are swapped around on removal
+	// so refer to tasks by id rather than position.
 	struct task *entries;
 	size_t len;
 	size_t cap;
+	// Indexed by task id, slots holds the position of the id in entries.
+	// Ids of removed tasks form a free list through slots starting at
+	// free_id, SIZE_MAX when empty.
+	struct taskinfo *info;
+	size_t *slots;
+	size_t info_len;
+	size_t info_cap;
+	size_t free_id;
+	// Number of tasks in TASK_STARTED
+	size_t running;
 };
 
-bool task_process(struct task *task, const struct state *state, const struct state *prev_state);
-struct task *task_clone(struct task *dst, const struct task *src);
-void task_deinit(struct task *task);
-bool tasklist_append(struct tasklist *list, const struct task *task);
+void activity_update(struct state *state, const struct state *prev_state,
+		const struct config *cfg);
+bool task_process(struct tasklist *list, size_t i, unsigned long jobs,
+		const struct state *state, const struct state *prev_state);
+bool task_resolve(struct taskinfo *info);
+struct taskinfo *task_clone(struct taskinfo *dst, const struct taskinfo *src);
+void task_deinit(struct taskinfo *info);
+bool tasklist_append(struct tasklist *list, struct task *task, const struct taskinfo *info);
 void tasklist_remove(struct tasklist *list, size_t i);
+void tasklist_deinit(struct tasklist *list);
+
+enum builtin builtin_parse(char *const *argv);
+bool builtin_run(const struct task *task, const struct taskinfo *info);
 
 enum log_level {
 	LOG_ERROR,
@@ -66,24 +241,68 @@ void log_info(const char *fmt, ...);
 __attribute__((format(printf, 1, 2)))
 void log_debug(const char *fmt, ...);
 
+// Heap allocations made on the main thread so far, only counted when built
+// with ALLOC_CHECK, and bytes in use
+struct alloc_usage {
+	uint64_t allocs;
+	uint64_t live;
+	size_t in_use;
+};
+
+void alloc_pause(void);
+void alloc_resume(void);
+void alloc_tick_begin(void);
+void alloc_tick_end(void);
+void alloc_usage(struct alloc_usage *u);
+void alloc_report(const char *what, const struct alloc_usage *before);
+
 char *strltrim(char *s);
 char *strrntrim(char *s, size_t len);
 char *strntrim(char *s, size_t len);
 char *strtolower(char *s);
 int strtobool(const char *s);
+size_t argv_size(char *const *argv);
+char **argv_dup(char *const *argv);
+char *state_filename(const char *name);
+bool mkdir_parents(char *path);
 
 
 struct config {
 	unsigned long delay;
+	unsigned long jobs;
+	bool expand_env;
+	char **displays;
+	char *history;
 	struct {
 		enum log_level level;
 		bool time;
 	} log;
 	struct tasklist tasks;
+	// EXPR_* inputs referred to by the expressions or power conditions of
+	// any task
+	uint8_t expr_inputs;
+	// Where sys/class/power_supply and proc/acpi/button/lid are read from
+	char *power_root;
+	// File the last successful run of each task is recorded in
+	char *runs;
+	// Socket state changes are pushed to subscribers on
+	char *socket;
+	// Worker threads running plugin tasks
+	size_t plugin_threads;
+	// Activity needed to end an idle period, see activity_update()
+	unsigned long min_active;
+	unsigned long min_inputs;
+	// Time a display may take to answer, and whether its state is then held
+	// rather than taken from pings
+	unsigned long query_timeout;
+	bool stall_hold;
 };
 
 #define CONFIG_INIT { \
 	.delay = 60000, \
+	.plugin_threads = 2, \
+	.query_timeout = XSS_TIMEOUT, \
+	.stall_hold = true, \
 	.log = { \
 		.level = LOG_INFO, \
 		.time = true, \
@@ -93,17 +312,121 @@ struct config {
 extern struct config config;
 
 bool config_load(const char *filename, struct config *cfg);
+bool config_reload(struct config *cur, const char *filename);
+bool config_reload_user(struct config *cur, FILE *f, const char *filename);
 bool config_load_and_swap(const char *filename);
 void config_deinit(struct config *cfg);
 
 
+bool status_init(void);
+void status_deinit(void);
+void status_update(const struct state *state, const struct tasklist *tasks);
+int status_print(void);
+
+
+// Inputs an expression can refer to
+#define EXPR_IDLE (1 << 0)
+#define EXPR_XSS  (1 << 1)
+#define EXPR_LOAD (1 << 2)
+#define EXPR_POWER (1 << 3)
+#define EXPR_LID  (1 << 4)
+
+struct expr *expr_compile(const char *s, char *err, size_t err_len);
+struct expr *expr_dup(const struct expr *e);
+uint8_t expr_inputs(const struct expr *e);
+bool expr_eval(struct expr *e, const struct state *state);
+bool expr_load(double load[3]);
+
+
+bool power_init(const char *root);
+void power_deinit(void);
+int power_fd(void);
+void power_handle(void);
+void power_get(struct state *state, bool lid);
+
+
+const struct idlemon_plugin *plugin_load(char *const *argv, void **handle);
+void plugin_deinit(void);
+void plugin_reserve(const struct tasklist *tasks);
+int plugin_fd(void);
+void plugin_handle(void);
+long plugin_start(const struct taskinfo *info);
+void plugin_cancel(long id);
+bool plugin_wait(long id, int *status);
+
+
+// Most pipelines capturing from a stage other than the last at a time
+#define PUMP_MAX 16
+
+size_t pump_add(int in, int out, int capture);
+bool pump_done(size_t id);
+void pump_free(size_t id);
+size_t pump_poll(struct pollfd *pfds, size_t len);
+void pump_handle(const struct pollfd *pfds, size_t len);
+
+
+bool events_init(const char *filename);
+void events_deinit(void);
+int events_fd(void);
+void events_handle(void);
+void events_update(const struct state *state, const struct state *prev_state);
+void events_task(const struct task *task, const struct taskinfo *info);
+
+
+bool runs_init(const char *filename);
+void runs_deinit(void);
+void runs_attach(struct tasklist *tasks);
+time_t runs_last_start(struct taskinfo *info);
+void runs_record(struct taskinfo *info);
+
+
+bool history_init(const char *filename);
+void history_deinit(void);
+void history_update(const struct state *state, const struct state *prev_state);
+bool history_expect(unsigned long idle, unsigned long expected);
+int history_print(const char *filename);
+
+
+bool upgrade_exec(char **argv, const struct state *states, size_t states_len,
+		time_t signal_time);
+bool upgrade_restore(struct tasklist *tasks, struct state *states, size_t states_len,
+		time_t *signal_time);
+
+
+enum dpms_level {
+	DPMS_ON,
+	DPMS_STANDBY,
+	DPMS_SUSPEND,
+	DPMS_OFF,
+};
+
+// Default time a display may take to answer before it counts as stalled
+#define XSS_TIMEOUT 5000
+
 struct xss {
 	unsigned long idle;
 	bool active;
+	// No reply in the timeout, idle and active are from the last one
+	bool stale;
 };
 
-void xss_init(void);
+void xss_init(char *const *displays);
 void xss_deinit(void);
-struct xss xss_query(void);
+bool xss_changed(char *const *displays);
+size_t xss_count(void);
+size_t xss_add(const char *name, const char *xauthority);
+void xss_remove(size_t i);
+bool xss_connected(size_t i);
+void xss_timeout(unsigned long ms);
+uint64_t xss_stalls(void);
+const struct xss *xss_query(void);
+bool xss_dpms(size_t display, enum dpms_level level);
+
+
+void sessions_scan(void);
+void sessions_reload(void);
+void sessions_process(const struct xss *xss);
+void sessions_deinit(void);
+bool session_enter(const struct session *s);
 
 #endif // IDLEMON_H
@@ -2,6 +2,7 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdio.h>
@@ -13,6 +14,7 @@
 #include <unistd.h>
 
 #include "idlemon.h"
+#include "trace.h"
 
 
 bool color_tty = true;
@@ -20,6 +22,8 @@ struct config config = CONFIG_INIT;
 
 static bool running = true;
 static bool reload_config = false;
+static bool dump_trace = false;
+static bool upgrade = false;
 static time_t signal_time = 0;
 
 
@@ -33,6 +37,12 @@ signal_handler(int sig)
 	case SIGUSR2:
 		reload_config = true;
 		break;
+	case SIGQUIT:
+		dump_trace = true;
+		break;
+	case SIGHUP:
+		upgrade = true;
+		break;
 	case SIGINT:
 		running = false;
 		break;
@@ -55,9 +65,20 @@ register_signal_handlers(void)
 	if (sigaction(SIGUSR2, &sa, NULL) == -1) {
 		return false;
 	}
+	if (sigaction(SIGHUP, &sa, NULL) == -1) {
+		return false;
+	}
+	if (sigaction(SIGQUIT, &sa, NULL) == -1) {
+		return false;
+	}
 	if (sigaction(SIGINT, &sa, NULL) == -1) {
 		return false;
 	}
+	// Caught rather than ignored so children start out with the default
+	// action, writes to pipeline stages that have gone fail with EPIPE.
+	if (sigaction(SIGPIPE, &sa, NULL) == -1) {
+		return false;
+	}
 	return true;
 }
 
@@ -68,6 +89,104 @@ signal_get_idle(void)
 	return now > signal_time ? (now - signal_time) * 1000 : 0;
 }
 
+static void
+states_alloc(struct state **states, struct state **prev_states, size_t *len)
+{
+	*len = xss_count() + 1;
+	if ((*states = calloc(*len, sizeof(**states))) == NULL ||
+			(*prev_states = calloc(*len, sizeof(**prev_states))) == NULL) {
+		log_fatal("calloc failed:");
+	}
+}
+
+// Waits until the tick due at *next, handling events in the meantime, and
+// moves *next on to the one after. A signal ends the wait early so it's acted
+// on straight away, *next is left as is then.
+static void
+wait_tick(struct timespec *next)
+{
+	for (;;) {
+		struct pollfd pfds[3 + PUMP_MAX] = {
+			// Ignored by poll() while negative
+			{ .fd = power_fd(), .events = POLLIN },
+			{ .fd = plugin_fd(), .events = POLLIN },
+			{ .fd = events_fd(), .events = POLLIN },
+		};
+		size_t pumps = pump_poll(pfds + 3, PUMP_MAX);
+		struct timespec now;
+		long timeout;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = (next->tv_sec - now.tv_sec) * 1000 +
+			(next->tv_nsec - now.tv_nsec) / 1000000;
+		if (timeout <= 0) {
+			// Don't try to catch up on ticks missed while suspended
+			if (timeout < -1000) {
+				*next = now;
+			}
+			next->tv_sec++;
+			return;
+		}
+
+		switch (poll(pfds, 3 + pumps, timeout)) {
+		case -1:
+			if (errno == EINTR) {
+				return;
+			}
+			log_fatal("poll failed:");
+		case 0:
+			break;
+		default:
+			if (pfds[0].revents & POLLIN) {
+				power_handle();
+			}
+			if (pfds[2].revents & POLLIN) {
+				events_handle();
+			}
+			pump_handle(pfds + 3, pumps);
+			// Reap finished plugin tasks without waiting for the tick
+			if (pfds[1].revents & POLLIN) {
+				plugin_handle();
+				return;
+			}
+			break;
+		}
+	}
+}
+
+// Monitors the X sessions of every logged in user, each with the tasks from
+// its user's config.
+static void
+run_system(void)
+{
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (running) {
+		if (dump_trace) {
+			trace_dump();
+			dump_trace = false;
+		}
+		if (upgrade) {
+			log_warn("upgrade not supported system wide");
+			upgrade = false;
+		}
+		if (reload_config) {
+			sessions_reload();
+			reload_config = false;
+		}
+
+		sessions_scan();
+		sessions_process(xss_query());
+		wait_tick(&next);
+	}
+
+	sessions_deinit();
+	xss_deinit();
+	power_deinit();
+}
+
 static char *
 xdg_config_filename(void)
 {
@@ -173,14 +292,20 @@ main(int argc, char **argv)
 {
 	int opt;
 	char *config_filename = NULL;
+	bool print_history = false;
+	bool system = false;
 	pid_t active_instance;
-	struct state state = {0}, prev_state = {0};
+	// Index 0 holds the aggregate of all displays, followed by the state of
+	// each display in config.displays order.
+	struct state *states, *prev_states;
+	size_t states_len;
+	struct timespec next;
 
 	color_tty = getenv("NO_COLOR") == NULL && isatty(STDERR_FILENO);
 
 	active_instance = get_active_instance();
 
-	while ((opt = getopt(argc, argv, "hprc:")) != -1) {
+	while ((opt = getopt(argc, argv, "hprstuHSc:")) != -1) {
 		switch (opt) {
 		case 'c':
 			if (config_filename != NULL) {
@@ -205,6 +330,31 @@ main(int argc, char **argv)
 			kill(active_instance, SIGUSR2);
 			return 0;
 
+		case 's':
+			return status_print();
+
+		case 't':
+			if (active_instance == -1) {
+				log_fatal("no active instance");
+			}
+			kill(active_instance, SIGQUIT);
+			return 0;
+
+		case 'u':
+			if (active_instance == -1) {
+				log_fatal("no active instance");
+			}
+			kill(active_instance, SIGHUP);
+			return 0;
+
+		case 'H':
+			print_history = true;
+			break;
+
+		case 'S':
+			system = true;
+			break;
+
 		case 'h':
 		default:
 			fprintf(stderr,
@@ -216,65 +366,238 @@ main(int argc, char **argv)
 					"  -c <filename> (default: ~/.config/idlemon.conf) config filename\n"
 					"  -p            ping active instance\n"
 					"  -r            reload config of active instance\n"
+					"  -s            print status of active instance\n"
+					"  -t            dump recent trace events of active instance\n"
+					"  -u            re-execute active instance keeping task state\n"
+					"  -H            print learned idle period lengths\n"
+					"  -S            monitor the sessions of all users (as root)\n"
 					"\n",
 					argv[0]);
 			exit(1);
 		}
 	}
 
-	// Only allow a single instance
-	if (active_instance != -1) {
-		log_fatal("active instance found");
+	if (system) {
+		if (active_instance != -1) {
+			log_fatal("active instance found");
+		}
+		if (geteuid() != 0) {
+			log_fatal("-S requires root");
+		}
+		// Only the global and [log] settings apply, tasks come from the
+		// config of each user.
+		if (config_filename != NULL && !config_load_and_swap(config_filename)) {
+			exit(1);
+		}
+		if (config.tasks.len > 0) {
+			log_warn("tasks in %s are ignored with -S", config_filename);
+		}
+		if (!register_signal_handlers()) {
+			log_fatal("failed to register signal handlers:");
+		}
+		if (!power_init(config.power_root)) {
+			log_warn("power state changes not tracked");
+		}
+		xss_timeout(config.query_timeout);
+		run_system();
+		config_deinit(&config);
+		free(config_filename);
+		log_info("finished");
+		return 0;
 	}
 
 	if (config_filename == NULL) {
 		config_filename = xdg_config_filename();
 	}
 
+	if (print_history) {
+		struct config cfg;
+		int r;
+
+		if (!config_load(config_filename, &cfg)) {
+			exit(1);
+		}
+		r = history_print(cfg.history);
+		config_deinit(&cfg);
+		free(config_filename);
+		return r;
+	}
+
+	// Only allow a single instance
+	if (active_instance != -1) {
+		log_fatal("active instance found");
+	}
+
 	if (!config_load_and_swap(config_filename)) {
 		exit(1);
 	}
 
-	xss_init();
+	xss_timeout(config.query_timeout);
+	xss_init(config.displays);
+	states_alloc(&states, &prev_states, &states_len);
+
+	if (!upgrade_restore(&config.tasks, prev_states, states_len, &signal_time)) {
+		log_warn("previous task state not restored");
+	}
 
 	if (!register_signal_handlers()) {
 		log_fatal("failed to register signal handlers:");
 	}
 
+	if (!status_init()) {
+		log_warn("status page not available");
+	}
+	if (!history_init(config.history)) {
+		log_warn("idle history not available");
+	}
+	if (!runs_init(config.runs)) {
+		log_warn("run history not available");
+	}
+	runs_attach(&config.tasks);
+	plugin_reserve(&config.tasks);
+	if (!power_init(config.power_root)) {
+		log_warn("power state changes not tracked");
+	}
+	if (!events_init(config.socket)) {
+		log_warn("event subscriptions not available");
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
 	while (running) {
 		unsigned long signal_idle;
-		struct xss xss;
+		const struct xss *xss;
+		uint64_t t;
+
+		if (dump_trace) {
+			trace_dump();
+			dump_trace = false;
+		}
+
+		if (upgrade) {
+			upgrade_exec(argv, prev_states, states_len, signal_time);
+			upgrade = false;
+		}
 
 		if (reload_config) {
-			config_load_and_swap(config_filename);
+			struct alloc_usage heap;
+			bool ok;
+
+			alloc_usage(&heap);
+			t = trace_now();
+			ok = config_load_and_swap(config_filename);
+			TRACE(RELOAD, 0, trace_now() - t, ok);
+
+			if (ok) {
+				xss_timeout(config.query_timeout);
+				power_deinit();
+				power_init(config.power_root);
+				runs_attach(&config.tasks);
+				plugin_reserve(&config.tasks);
+			}
+			if (ok && xss_changed(config.displays)) {
+				xss_deinit();
+				xss_init(config.displays);
+				free(states);
+				free(prev_states);
+				states_alloc(&states, &prev_states, &states_len);
+			}
+			alloc_report("reload", &heap);
 			reload_config = false;
 		}
 
+		// Nothing from here until the next tick should allocate
+		alloc_tick_begin();
+
+		t = trace_now();
 		xss = xss_query();
+		TRACE(IDLE_QUERY, 0, trace_now() - t, states_len - 1);
 		signal_idle = signal_get_idle();
 
-		state.idle = xss.idle < signal_idle ? xss.idle : signal_idle;
-		state.xss_active = xss.active;
+		// The aggregate is idle only as long as every display is idle and
+		// has the screensaver active only when all of them do.
+		states[0].idle = signal_idle;
+		states[0].xss_active = true;
+		if ((config.expr_inputs & EXPR_LOAD) && !expr_load(states[0].load)) {
+			memset(states[0].load, 0, sizeof(states[0].load));
+		}
+		power_get(&states[0], config.expr_inputs & EXPR_LID);
+
+		for (size_t i = 1; i < states_len; i++) {
+			struct state *state = &states[i];
+
+			if (!xss[i - 1].stale) {
+				state->idle = xss[i - 1].idle < signal_idle ? xss[i - 1].idle : signal_idle;
+				state->xss_active = xss[i - 1].active;
+			} else if (config.stall_hold) {
+				// Nothing starts or resets until the display answers
+				state->idle = prev_states[i].idle;
+				state->xss_active = prev_states[i].xss_active;
+			} else {
+				state->idle = signal_idle;
+				state->xss_active = false;
+			}
+			memcpy(state->load, states[0].load, sizeof(state->load));
+			state->power = states[0].power;
+			state->battery = states[0].battery;
 
-		log_debug("loop: idle=%ld, xss_active=%s", state.idle,
-				state.xss_active ? "true" : "false");
+			if (state->idle < states[0].idle) {
+				states[0].idle = state->idle;
+			}
+			states[0].xss_active = states[0].xss_active && state->xss_active;
+
+			if (states_len > 2) {
+				log_debug("loop: display=%zu, idle=%ld, xss_active=%s", i - 1,
+						state->idle, state->xss_active ? "true" : "false");
+			}
+		}
+
+		for (size_t i = 0; i < states_len; i++) {
+			activity_update(&states[i], &prev_states[i], &config);
+		}
+
+		log_debug("loop: idle=%ld, xss_active=%s", states[0].idle,
+				states[0].xss_active ? "true" : "false");
+		TRACE(TICK, 0, states[0].idle, states[0].xss_active);
+
+		events_update(&states[0], &prev_states[0]);
 
 		for (size_t i = 0; i < config.tasks.len;) {
 			struct task *task = &config.tasks.entries[i];
-			if (task_process(task, &state, &prev_state)) {
-				log_debug("removed temporary task '%s'", task->name);
+			size_t n = task->display < states_len ? task->display : 0;
+			uint8_t task_state = task->state;
+			bool removed = task_process(&config.tasks, i, config.jobs,
+					&states[n], &prev_states[n]);
+
+			if (task->state != task_state) {
+				events_task(task, &config.tasks.info[task->id]);
+			}
+			if (removed) {
+				log_debug("removed temporary task '%s'", config.tasks.info[task->id].name);
 				tasklist_remove(&config.tasks, i);
 			} else {
 				i++;
 			}
 		}
 
-		memcpy(&prev_state, &state, sizeof(prev_state));
-		sleep(1);
+		status_update(&states[0], &config.tasks);
+		history_update(&states[0], &prev_states[0]);
+
+		memcpy(prev_states, states, states_len * sizeof(*prev_states));
+		alloc_tick_end();
+		wait_tick(&next);
 	}
 
+	power_deinit();
+	plugin_deinit();
+	events_deinit();
+	status_deinit();
+	history_deinit();
+	runs_deinit();
 	config_deinit(&config);
 	xss_deinit();
+	free(states);
+	free(prev_states);
 	free(config_filename);
 
 	log_info("finished");
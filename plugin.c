@@ -0,0 +1,355 @@
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "idlemon.h"
+#include "idlemon-plugin.h"
+
+// A single run of a plugin task. Jobs are created and freed on the main
+// thread, workers only run them and set done.
+struct job {
+	const struct idlemon_plugin *plugin;
+	// Our own reference, the task may be unloaded by a reload before the
+	// job finishes
+	void *handle;
+	void *ctx;
+	int status;
+	bool done;
+	bool cancelled;
+	struct job *next;
+};
+
+static pthread_t *workers = NULL;
+static size_t workers_len = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct job *queue_head = NULL;
+static struct job *queue_tail = NULL;
+static bool stopping = false;
+static int efd = -1;
+
+// Indexed by job id, which running plugin tasks keep in their pid
+static struct job **jobs = NULL;
+static size_t jobs_cap = 0;
+// Jobs not in use, kept so runs don't allocate, and the number of jobs there
+// are in all
+static struct job *free_jobs = NULL;
+static size_t jobs_len = 0;
+
+
+static void *
+worker(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		struct job *job;
+		uint64_t one = 1;
+		ssize_t r;
+
+		pthread_mutex_lock(&lock);
+		while (queue_head == NULL && !stopping) {
+			pthread_cond_wait(&cond, &lock);
+		}
+		if (queue_head == NULL) {
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		job = queue_head;
+		if ((queue_head = job->next) == NULL) {
+			queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&lock);
+
+		job->status = __atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)
+			? -1 : job->plugin->run(job->ctx);
+		__atomic_store_n(&job->done, true, __ATOMIC_RELEASE);
+
+		// Wake the main loop, the counter is reset when it's drained
+		r = write(efd, &one, sizeof(one));
+		(void)r;
+	}
+}
+
+// Loads the plugin of a task. argv[0] is the path of the shared object.
+const struct idlemon_plugin *
+plugin_load(char *const *argv, void **handle)
+{
+	const struct idlemon_plugin *plugin;
+
+	if ((*handle = dlopen(argv[0], RTLD_NOW | RTLD_LOCAL)) == NULL) {
+		log_error("plugin: %s", dlerror());
+		return NULL;
+	}
+	if ((plugin = dlsym(*handle, IDLEMON_PLUGIN_SYMBOL)) == NULL) {
+		log_error("plugin: %s doesn't export %s", argv[0], IDLEMON_PLUGIN_SYMBOL);
+		goto failed;
+	}
+	if (plugin->version != IDLEMON_PLUGIN_VERSION) {
+		log_error("plugin: %s has version %u, expected %u", argv[0],
+				(unsigned)plugin->version, IDLEMON_PLUGIN_VERSION);
+		goto failed;
+	}
+	if (plugin->run == NULL) {
+		log_error("plugin: %s has no run callback", argv[0]);
+		goto failed;
+	}
+	return plugin;
+
+failed:
+	dlclose(*handle);
+	*handle = NULL;
+	return NULL;
+}
+
+// Starts the worker threads, once the first plugin task is loaded.
+static bool
+plugin_init(void)
+{
+	if (workers != NULL) {
+		return true;
+	}
+
+	if ((efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+		log_error("plugin: eventfd failed:");
+		return false;
+	}
+	if ((workers = calloc(config.plugin_threads, sizeof(*workers))) == NULL) {
+		log_error("plugin: calloc failed:");
+		return false;
+	}
+	for (workers_len = 0; workers_len < config.plugin_threads; workers_len++) {
+		int err = pthread_create(&workers[workers_len], NULL, worker, NULL);
+
+		if (err != 0) {
+			errno = err;
+			log_error("plugin: failed to create thread:");
+			break;
+		}
+	}
+	if (workers_len == 0) {
+		free(workers);
+		workers = NULL;
+		return false;
+	}
+
+	log_debug("plugin: started %zu worker threads", workers_len);
+	return true;
+}
+
+void
+plugin_deinit(void)
+{
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	for (size_t i = 0; i < jobs_cap; i++) {
+		if (jobs[i] != NULL) {
+			plugin_cancel(i);
+		}
+	}
+	for (size_t i = 0; i < workers_len; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	// Workers finish the queue before stopping, so every job is done
+	for (size_t i = 0; i < jobs_cap; i++) {
+		int status;
+
+		if (jobs[i] != NULL) {
+			plugin_wait(i, &status);
+		}
+	}
+
+	while (free_jobs != NULL) {
+		struct job *job = free_jobs;
+
+		free_jobs = job->next;
+		free(job);
+	}
+	jobs_len = 0;
+	free(workers);
+	free(jobs);
+	workers = NULL;
+	workers_len = 0;
+	jobs = NULL;
+	jobs_cap = 0;
+	queue_head = queue_tail = NULL;
+	stopping = false;
+	if (efd != -1) {
+		close(efd);
+		efd = -1;
+	}
+}
+
+int
+plugin_fd(void)
+{
+	return efd;
+}
+
+void
+plugin_handle(void)
+{
+	uint64_t n;
+	ssize_t r = read(efd, &n, sizeof(n));
+
+	(void)r;
+}
+
+// Makes room for at least n jobs, in the table and the pool.
+static bool
+jobs_reserve(size_t n)
+{
+	if (n > jobs_cap) {
+		size_t cap = jobs_cap == 0 ? 8 : jobs_cap;
+		struct job **js;
+
+		while (cap < n) {
+			cap *= 2;
+		}
+		if ((js = realloc(jobs, cap * sizeof(*js))) == NULL) {
+			log_error("plugin: realloc failed:");
+			return false;
+		}
+		memset(js + jobs_cap, 0, (cap - jobs_cap) * sizeof(*js));
+		jobs = js;
+		jobs_cap = cap;
+	}
+	for (; jobs_len < n; jobs_len++) {
+		struct job *job = calloc(1, sizeof(*job));
+
+		if (job == NULL) {
+			log_error("plugin: calloc failed:");
+			return false;
+		}
+		job->next = free_jobs;
+		free_jobs = job;
+	}
+	return true;
+}
+
+// Starts the workers and sets aside a job for every plugin task, so that
+// starting them doesn't allocate. Called whenever the tasks are loaded.
+void
+plugin_reserve(const struct tasklist *tasks)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < tasks->len; i++) {
+		if (tasks->entries[i].flags & TASK_PLUGIN) {
+			n++;
+		}
+	}
+	if (n > 0 && plugin_init()) {
+		jobs_reserve(n);
+	}
+}
+
+// Queues a run of the task's plugin, returning the job id or -1.
+long
+plugin_start(const struct taskinfo *info)
+{
+	struct job *job;
+	size_t id;
+
+	if (!plugin_init()) {
+		return -1;
+	}
+
+	for (id = 0; id < jobs_cap; id++) {
+		if (jobs[id] == NULL) {
+			break;
+		}
+	}
+	// Only short if plugin_reserve() failed
+	if ((id == jobs_cap || free_jobs == NULL) && !jobs_reserve(jobs_len + 1)) {
+		return -1;
+	}
+
+	job = free_jobs;
+	free_jobs = job->next;
+	memset(job, 0, sizeof(*job));
+
+	// dlopen() and the plugin's own callbacks are free to allocate
+	alloc_pause();
+	job->handle = dlopen(info->argv[0], RTLD_NOW | RTLD_LOCAL);
+	alloc_resume();
+	if (job->handle == NULL) {
+		log_error("plugin: %s", dlerror());
+		job->next = free_jobs;
+		free_jobs = job;
+		return -1;
+	}
+	job->plugin = info->plugin;
+
+	alloc_pause();
+	if (job->plugin->init != NULL && (job->ctx = job->plugin->init(info->argv)) == NULL) {
+		alloc_resume();
+		log_error("task: [%s] plugin failed to initialize", info->name);
+		dlclose(job->handle);
+		job->next = free_jobs;
+		free_jobs = job;
+		return -1;
+	}
+	alloc_resume();
+
+	jobs[id] = job;
+
+	pthread_mutex_lock(&lock);
+	if (queue_tail != NULL) {
+		queue_tail->next = job;
+	} else {
+		queue_head = job;
+	}
+	queue_tail = job;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+
+	return id;
+}
+
+// Asks a running job to stop early. It still has to be waited on.
+void
+plugin_cancel(long id)
+{
+	struct job *job = jobs[id];
+
+	if (job->cancelled) {
+		return;
+	}
+	__atomic_store_n(&job->cancelled, true, __ATOMIC_RELAXED);
+	if (job->plugin->cancel != NULL) {
+		job->plugin->cancel(job->ctx);
+	}
+}
+
+// Collects a finished job, returning false while it's still running.
+bool
+plugin_wait(long id, int *status)
+{
+	struct job *job = jobs[id];
+
+	if (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE)) {
+		return false;
+	}
+
+	*status = job->status;
+	alloc_pause();
+	if (job->plugin->deinit != NULL) {
+		job->plugin->deinit(job->ctx);
+	}
+	dlclose(job->handle);
+	alloc_resume();
+	job->next = free_jobs;
+	free_jobs = job;
+	jobs[id] = NULL;
+	return true;
+}
@@ -0,0 +1,247 @@
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/netlink.h>
+
+#include "idlemon.h"
+
+static int sock = -1;
+static char *root = NULL;
+static uint8_t power = POWER_AC;
+static uint8_t battery = 100;
+// Entry below proc/acpi/button/lid, empty if there's no lid
+static char lid_name[NAME_MAX + 1];
+
+
+// Reads the first line of root/dir/name/file into buf.
+static bool
+read_attr(const char *dir, const char *name, const char *file, char *buf, size_t len)
+{
+	char path[PATH_MAX];
+	ssize_t n;
+	int fd;
+	int r;
+
+	// Read directly, the lid is read on every tick and fopen() allocates
+	r = snprintf(path, sizeof(path), "%s/%s/%s/%s", root, dir, name, file);
+	if (r < 0 || (size_t)r >= sizeof(path) ||
+			(fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		return false;
+	}
+	n = read(fd, buf, len - 1);
+	close(fd);
+	if (n <= 0) {
+		return false;
+	}
+	buf[n] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return true;
+}
+
+static void
+read_supplies(void)
+{
+	const char *dir = "sys/class/power_supply";
+	char path[PATH_MAX];
+	bool mains = false, online = false;
+	unsigned long capacity = 0, batteries = 0;
+	struct dirent *entry;
+	DIR *d;
+
+	snprintf(path, sizeof(path), "%s/%s", root, dir);
+	if ((d = opendir(path)) == NULL) {
+		if (errno != ENOENT) {
+			log_warn("power: failed to open %s:", path);
+		}
+		power |= POWER_AC;
+		power &= ~POWER_BATTERY;
+		battery = 100;
+		return;
+	}
+
+	while ((entry = readdir(d)) != NULL) {
+		char type[32], value[32];
+
+		if (entry->d_name[0] == '.' ||
+				!read_attr(dir, entry->d_name, "type", type, sizeof(type))) {
+			continue;
+		}
+
+		if (strcmp(type, "Battery") == 0) {
+			// Peripherals like mice report their batteries here too
+			if (read_attr(dir, entry->d_name, "scope", value, sizeof(value)) &&
+					strcmp(value, "Device") == 0) {
+				continue;
+			}
+			if (read_attr(dir, entry->d_name, "capacity", value, sizeof(value))) {
+				capacity += strtoul(value, NULL, 10);
+				batteries++;
+			}
+		} else if (strcmp(type, "Mains") == 0 || strncmp(type, "USB", 3) == 0) {
+			mains = true;
+			if (read_attr(dir, entry->d_name, "online", value, sizeof(value)) &&
+					strcmp(value, "1") == 0) {
+				online = true;
+			}
+		}
+	}
+	closedir(d);
+
+	// Machines without any supply listed are taken to be on mains
+	if (online || !mains) {
+		power = (power & ~POWER_BATTERY) | POWER_AC;
+	} else {
+		power = (power & ~POWER_AC) | POWER_BATTERY;
+	}
+	battery = batteries > 0 ? capacity / batteries : 100;
+	if (battery > 100) {
+		battery = 100;
+	}
+}
+
+#define LID_DIR "proc/acpi/button/lid"
+
+// Finds the lid switch, once as it doesn't come and go.
+static void
+find_lid(void)
+{
+	char path[PATH_MAX];
+	struct dirent *entry;
+	DIR *d;
+
+	lid_name[0] = '\0';
+
+	snprintf(path, sizeof(path), "%s/%s", root, LID_DIR);
+	if ((d = opendir(path)) == NULL) {
+		return;
+	}
+	while ((entry = readdir(d)) != NULL) {
+		char state[64];
+
+		if (entry->d_name[0] != '.' &&
+				read_attr(LID_DIR, entry->d_name, "state", state, sizeof(state))) {
+			snprintf(lid_name, sizeof(lid_name), "%s", entry->d_name);
+			break;
+		}
+	}
+	closedir(d);
+}
+
+// The lid switch doesn't send uevents so this is read on every tick, but only
+// when a task refers to it.
+static void
+read_lid(void)
+{
+	char state[64];
+
+	power &= ~POWER_LID_CLOSED;
+
+	// "state:      closed"
+	if (lid_name[0] != '\0' && read_attr(LID_DIR, lid_name, "state", state, sizeof(state)) &&
+			strstr(state, "closed") != NULL) {
+		power |= POWER_LID_CLOSED;
+	}
+}
+
+// Starts tracking the power supplies below path (normally "/"). Supplies are
+// read once here and then again only when the kernel reports a change.
+bool
+power_init(const char *path)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		// Kernel uevents
+		.nl_groups = 1,
+	};
+
+	if ((root = strdup(path != NULL ? path : "/")) == NULL) {
+		log_error("power: strdup failed:");
+		return false;
+	}
+
+	read_supplies();
+	find_lid();
+	read_lid();
+
+	if ((sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+					NETLINK_KOBJECT_UEVENT)) == -1) {
+		log_warn("power: failed to open uevent socket:");
+		return false;
+	}
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		log_warn("power: failed to bind uevent socket:");
+		close(sock);
+		sock = -1;
+		return false;
+	}
+
+	log_debug("power: ac=%s, battery=%u%%", power & POWER_AC ? "true" : "false",
+			(unsigned)battery);
+	return true;
+}
+
+void
+power_deinit(void)
+{
+	if (sock != -1) {
+		close(sock);
+		sock = -1;
+	}
+	free(root);
+	root = NULL;
+}
+
+int
+power_fd(void)
+{
+	return sock;
+}
+
+// Drains the uevent socket, reading the supplies again if any of the events
+// were about them.
+void
+power_handle(void)
+{
+	char buf[4096];
+	bool changed = false;
+	ssize_t n;
+
+	while ((n = recv(sock, buf, sizeof(buf) - 1, 0)) > 0) {
+		// "ACTION@DEVPATH" followed by NUL separated KEY=VALUE pairs
+		buf[n] = '\0';
+		for (char *s = buf; s < buf + n; s += strlen(s) + 1) {
+			if (strcmp(s, "SUBSYSTEM=power_supply") == 0) {
+				changed = true;
+				break;
+			}
+		}
+	}
+	if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		log_warn("power: failed to read uevent:");
+	}
+
+	if (changed) {
+		read_supplies();
+		log_debug("power: ac=%s, battery=%u%%", power & POWER_AC ? "true" : "false",
+				(unsigned)battery);
+	}
+}
+
+// Fills in the power fields of state, reading the lid too if asked to.
+void
+power_get(struct state *state, bool lid)
+{
+	if (lid && root != NULL) {
+		read_lid();
+	}
+	state->power = power;
+	state->battery = battery;
+}
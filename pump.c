@@ -0,0 +1,219 @@
+// tee(), splice()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "idlemon.h"
+
+// Most bytes moved per call, and calls per pump each time it's polled so a
+// fast stage can't hold up the main loop
+#define PUMP_CHUNK (64 * 1024)
+#define PUMP_ROUNDS 16
+
+// Duplicates what a stage writes into the next stage's input and the capture
+// file. tee() and splice() move the pages between the pipes and into the file
+// without copying them through idlemon.
+struct pump {
+	bool used;
+	bool done;
+	// The next stage isn't reading, wait for out to become writable
+	bool blocked;
+	int in;
+	// -1 once the next stage has gone or the capture failed
+	int out;
+	int capture;
+	// Entry in the pollfds of the last pump_poll(), SIZE_MAX if none
+	size_t pfd;
+};
+
+static struct pump pumps[PUMP_MAX];
+
+
+static void
+close_fd(int *fd)
+{
+	if (*fd != -1) {
+		close(*fd);
+		*fd = -1;
+	}
+}
+
+// Reads and drops len bytes of output that's already there.
+static void
+discard(int fd, size_t len)
+{
+	char buf[4096];
+
+	while (len > 0) {
+		ssize_t n = read(fd, buf, len > sizeof(buf) ? sizeof(buf) : len);
+
+		if (n <= 0) {
+			return;
+		}
+		len -= n;
+	}
+}
+
+static void
+pump_finish(struct pump *p)
+{
+	close_fd(&p->in);
+	close_fd(&p->out);
+	close_fd(&p->capture);
+	p->done = true;
+}
+
+// Moves len bytes that were just teed out of in into the capture file.
+static void
+drain(struct pump *p, size_t len)
+{
+	while (len > 0 && p->capture != -1) {
+		ssize_t n = splice(p->in, NULL, p->capture, NULL, len, 0);
+
+		if (n <= 0) {
+			log_warn("pump: failed to write capture file:");
+			close_fd(&p->capture);
+			break;
+		}
+		len -= n;
+	}
+	if (len > 0) {
+		discard(p->in, len);
+	}
+}
+
+static void
+pump_run(struct pump *p)
+{
+	for (int i = 0; i < PUMP_ROUNDS; i++) {
+		ssize_t n;
+
+		if (p->out != -1) {
+			n = tee(p->in, p->out, PUMP_CHUNK, SPLICE_F_NONBLOCK);
+		} else if (p->capture != -1) {
+			n = splice(p->in, NULL, p->capture, NULL, PUMP_CHUNK, SPLICE_F_NONBLOCK);
+		} else {
+			// Nowhere left to send it, keep the stage from blocking
+			char buf[4096];
+			n = read(p->in, buf, sizeof(buf));
+		}
+
+		if (n == 0) {
+			// The stage closed its output
+			pump_finish(p);
+			return;
+		}
+		if (n == -1) {
+			int avail = 0;
+
+			if (errno != EAGAIN) {
+				if (errno != EPIPE) {
+					log_warn("pump: failed to pass on output:");
+				}
+				if (p->out != -1) {
+					close_fd(&p->out);
+				} else if (p->capture != -1) {
+					close_fd(&p->capture);
+				} else {
+					pump_finish(p);
+					return;
+				}
+				continue;
+			}
+			// Either in is empty or out is full
+			if (p->out != -1 && ioctl(p->in, FIONREAD, &avail) == 0 && avail > 0) {
+				p->blocked = true;
+			}
+			return;
+		}
+		if (p->out != -1) {
+			drain(p, n);
+		}
+	}
+}
+
+// Starts pumping the output of a stage from in to out and the capture file,
+// taking over the descriptors. Returns the pump's id, 0 if all are in use.
+size_t
+pump_add(int in, int out, int capture)
+{
+	for (size_t i = 0; i < PUMP_MAX; i++) {
+		struct pump *p = &pumps[i];
+
+		if (p->used) {
+			continue;
+		}
+		// Only our ends, the stages' ends stay blocking
+		if (fcntl(in, F_SETFL, O_NONBLOCK) == -1 ||
+				fcntl(out, F_SETFL, O_NONBLOCK) == -1) {
+			log_error("pump: fcntl failed:");
+			return 0;
+		}
+		*p = (struct pump){
+			.used = true,
+			.in = in,
+			.out = out,
+			.capture = capture,
+			.pfd = SIZE_MAX,
+		};
+		return i + 1;
+	}
+	log_error("pump: more than %d pipelines capturing at once", PUMP_MAX);
+	return 0;
+}
+
+bool
+pump_done(size_t id)
+{
+	return pumps[id - 1].done;
+}
+
+void
+pump_free(size_t id)
+{
+	struct pump *p = &pumps[id - 1];
+
+	pump_finish(p);
+	p->used = false;
+}
+
+// Fills in the descriptors to wait on for the running pumps, returning how
+// many were used.
+size_t
+pump_poll(struct pollfd *pfds, size_t len)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < PUMP_MAX; i++) {
+		struct pump *p = &pumps[i];
+
+		p->pfd = SIZE_MAX;
+		if (!p->used || p->done || n >= len) {
+			continue;
+		}
+		pfds[n] = p->blocked
+			? (struct pollfd){ .fd = p->out, .events = POLLOUT }
+			: (struct pollfd){ .fd = p->in, .events = POLLIN };
+		p->pfd = n++;
+	}
+	return n;
+}
+
+void
+pump_handle(const struct pollfd *pfds, size_t len)
+{
+	for (size_t i = 0; i < PUMP_MAX; i++) {
+		struct pump *p = &pumps[i];
+
+		if (p->pfd >= len || pfds[p->pfd].revents == 0) {
+			continue;
+		}
+		p->blocked = false;
+		pump_run(p);
+	}
+}
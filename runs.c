@@ -0,0 +1,362 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "idlemon.h"
+
+#define RUNS_MAGIC 0x4e555249u
+#define RUNS_VERSION 1
+// The log is rewritten with one record per task once it holds this many
+// times more, and at least RUNS_MIN_COMPACT records
+#define RUNS_SLACK 4
+#define RUNS_MIN_COMPACT 64
+
+struct runs_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+// Followed by name_len bytes of the task name. The checksum covers the rest
+// of the record and the name, so one torn by a crash is told apart.
+struct runs_record {
+	uint32_t checksum;
+	uint16_t name_len;
+	uint16_t reserved;
+	// Unix time in seconds of the last successful run
+	int64_t start;
+	int64_t end;
+};
+
+struct run {
+	char *name;
+	int64_t start;
+	int64_t end;
+	// A task of the current config has this entry, the others are left out
+	// when compacting. They stay in runs, tasks refer to entries by index.
+	bool used;
+};
+
+static char *path = NULL;
+static int fd = -1;
+static struct run *runs = NULL;
+static size_t runs_len = 0;
+static size_t runs_cap = 0;
+// Number of records in the log, including those superseded since
+static size_t records = 0;
+
+
+static uint32_t
+checksum(const struct runs_record *r, const char *name)
+{
+	// FNV-1a
+	const unsigned char *p = (const unsigned char *)r + offsetof(struct runs_record, name_len);
+	const unsigned char *end = (const unsigned char *)(r + 1);
+	uint32_t h = 0x811c9dc5;
+
+	for (; p < end; p++) {
+		h = (h ^ *p) * 0x01000193;
+	}
+	for (size_t i = 0; i < r->name_len; i++) {
+		h = (h ^ (unsigned char)name[i]) * 0x01000193;
+	}
+	return h;
+}
+
+// Returns the slot of name, adding an empty one if it isn't known yet.
+static size_t
+runs_find(const char *name, size_t len)
+{
+	struct run *r;
+
+	for (size_t i = 0; i < runs_len; i++) {
+		if (strncmp(runs[i].name, name, len) == 0 && runs[i].name[len] == '\0') {
+			return i;
+		}
+	}
+
+	if (runs_len >= runs_cap) {
+		size_t cap = runs_cap == 0 ? 16 : runs_cap * 2;
+
+		if ((r = realloc(runs, cap * sizeof(*r))) == NULL) {
+			log_error("runs: realloc failed:");
+			return SIZE_MAX;
+		}
+		runs = r;
+		runs_cap = cap;
+	}
+	r = &runs[runs_len];
+	if ((r->name = strndup(name, len)) == NULL) {
+		log_error("runs: strndup failed:");
+		return SIZE_MAX;
+	}
+	r->start = 0;
+	r->end = 0;
+	r->used = false;
+	return runs_len++;
+}
+
+static bool
+write_record(int out, const struct run *run)
+{
+	size_t len = strlen(run->name);
+	struct runs_record r = {
+		.name_len = len > UINT16_MAX ? UINT16_MAX : len,
+		.start = run->start,
+		.end = run->end,
+	};
+	struct iovec iov[] = {
+		{ .iov_base = &r, .iov_len = sizeof(r) },
+		{ .iov_base = run->name, .iov_len = r.name_len },
+	};
+
+	r.checksum = checksum(&r, run->name);
+	// A single write so a crash tears at most this record
+	return writev(out, iov, 2) == (ssize_t)(sizeof(r) + r.name_len);
+}
+
+// Rewrites the log with a record per task through a temporary file, so a
+// crash leaves either the old or the new log in place.
+static bool
+runs_compact(void)
+{
+	struct runs_header hdr = { .magic = RUNS_MAGIC, .version = RUNS_VERSION };
+	char tmp[PATH_MAX];
+	size_t written = 0;
+	int out;
+	int r;
+
+	r = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (r < 0 || (size_t)r >= sizeof(tmp)) {
+		log_error("runs: path overflow");
+		return false;
+	}
+	if ((out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1) {
+		log_error("runs: failed to open %s:", tmp);
+		return false;
+	}
+	if (write(out, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		goto failed;
+	}
+	for (size_t i = 0; i < runs_len; i++) {
+		if (!runs[i].used || runs[i].start == 0) {
+			continue;
+		}
+		if (!write_record(out, &runs[i])) {
+			goto failed;
+		}
+		written++;
+	}
+	if (fsync(out) == -1) {
+		goto failed;
+	}
+	close(out);
+
+	if (rename(tmp, path) == -1) {
+		log_error("runs: failed to replace %s:", path);
+		unlink(tmp);
+		return false;
+	}
+
+	// The old file is gone, carry on appending to the new one
+	if (fd != -1) {
+		close(fd);
+	}
+	if ((fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC)) == -1) {
+		log_error("runs: failed to open %s:", path);
+		return false;
+	}
+	records = written;
+	log_debug("runs: compacted %s", path);
+	return true;
+
+failed:
+	log_error("runs: failed to write %s:", tmp);
+	close(out);
+	unlink(tmp);
+	return false;
+}
+
+// Reads the log into runs. Returns the offset up to which it's valid, which
+// is 0 when the file is new or incompatible.
+static off_t
+runs_load(FILE *f)
+{
+	struct runs_header hdr;
+	off_t valid;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+			hdr.magic != RUNS_MAGIC || hdr.version != RUNS_VERSION) {
+		return 0;
+	}
+	valid = sizeof(hdr);
+
+	for (;;) {
+		struct runs_record r;
+		char name[UINT16_MAX];
+		size_t i;
+
+		if (fread(&r, sizeof(r), 1, f) != 1 ||
+				fread(name, 1, r.name_len, f) != r.name_len ||
+				r.checksum != checksum(&r, name)) {
+			break;
+		}
+		if ((i = runs_find(name, r.name_len)) != SIZE_MAX) {
+			runs[i].start = r.start;
+			runs[i].end = r.end;
+		}
+		valid += sizeof(r) + r.name_len;
+		records++;
+	}
+	return valid;
+}
+
+bool
+runs_init(const char *filename)
+{
+	FILE *f;
+	off_t valid = 0;
+	off_t size;
+
+	if ((path = filename != NULL ? strdup(filename) : state_filename("runs")) == NULL) {
+		return false;
+	}
+	if (!mkdir_parents(path)) {
+		goto failed;
+	}
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) == -1) {
+		log_error("runs: failed to open %s:", path);
+		goto failed;
+	}
+	if ((f = fopen(path, "r")) == NULL) {
+		log_error("runs: failed to open %s:", path);
+		goto failed;
+	}
+	valid = runs_load(f);
+	fseeko(f, 0, SEEK_END);
+	size = ftello(f);
+	fclose(f);
+
+	if (valid == 0) {
+		if (size > 0) {
+			log_warn("runs: discarding incompatible %s", path);
+		}
+		if (!runs_compact()) {
+			goto failed;
+		}
+	} else if (valid < size) {
+		// Appends are single writes, so only the tail can be torn
+		log_warn("runs: dropping %lld bytes torn from the end of %s",
+				(long long)(size - valid), path);
+		if (ftruncate(fd, valid) == -1) {
+			log_error("runs: failed to truncate %s:", path);
+			goto failed;
+		}
+	}
+
+	log_debug("runs: loaded %zu tasks from %s", runs_len, path);
+	return true;
+
+failed:
+	runs_deinit();
+	return false;
+}
+
+void
+runs_deinit(void)
+{
+	if (fd != -1) {
+		close(fd);
+		fd = -1;
+	}
+	for (size_t i = 0; i < runs_len; i++) {
+		free(runs[i].name);
+	}
+	free(runs);
+	free(path);
+	runs = NULL;
+	runs_len = runs_cap = 0;
+	records = 0;
+	path = NULL;
+}
+
+// The task's entry, looked up by name only the first time, which may allocate.
+static struct run *
+runs_get(struct taskinfo *info)
+{
+	size_t i;
+
+	if (fd == -1) {
+		return NULL;
+	}
+	if (info->run_slot == 0) {
+		if ((i = runs_find(info->name, strlen(info->name))) == SIZE_MAX) {
+			return NULL;
+		}
+		info->run_slot = i + 1;
+	}
+	return &runs[info->run_slot - 1];
+}
+
+// Looks up the entries of the tasks that don't have one yet, so it's not done
+// while they run, and marks the entries of tasks no longer in the config.
+void
+runs_attach(struct tasklist *tasks)
+{
+	for (size_t i = 0; i < runs_len; i++) {
+		runs[i].used = false;
+	}
+	for (size_t i = 0; i < tasks->len; i++) {
+		struct run *run = runs_get(&tasks->info[tasks->entries[i].id]);
+
+		if (run != NULL) {
+			run->used = true;
+		}
+	}
+}
+
+// Unix time the last successful run of the task started, 0 if never.
+time_t
+runs_last_start(struct taskinfo *info)
+{
+	struct run *run = runs_get(info);
+
+	return run != NULL ? run->start : 0;
+}
+
+// Records the run that just succeeded.
+void
+runs_record(struct taskinfo *info)
+{
+	struct run *run = runs_get(info);
+	off_t end;
+
+	if (run == NULL) {
+		return;
+	}
+	run->start = info->last_start;
+	run->end = info->last_exit;
+	run->used = true;
+
+	end = lseek(fd, 0, SEEK_END);
+	if (end == -1 || !write_record(fd, run) || fdatasync(fd) == -1) {
+		log_error("runs: failed to write %s:", path);
+		// Loading stops at a torn record, so one can't be left in front of
+		// those appended later
+		if (end == -1 || ftruncate(fd, end) == -1) {
+			runs_compact();
+		}
+		return;
+	}
+	if (++records >= RUNS_MIN_COMPACT && records > RUNS_SLACK * runs_len) {
+		runs_compact();
+	}
+}
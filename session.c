@@ -0,0 +1,509 @@
+// getgrouplist(), setgroups()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <paths.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utmpx.h>
+
+#include "idlemon.h"
+
+// Search path for tasks, users' shell profiles aren't read
+#define SESSION_PATH "/usr/local/bin:/usr/bin:/bin"
+
+// An X session of a logged in user, as recorded in utmpx by the display
+// manager, and the tasks from that user's config.
+struct session {
+	// X display name, e.g. ":0", sessions are looked up by it
+	char *display;
+	// Index of the display in xss_query() results
+	size_t xss;
+	uid_t uid;
+	gid_t gid;
+	gid_t *groups;
+	int groups_len;
+	char *home;
+	// cgroup.procs of the session's cgroup, NULL if unknown
+	char *cgroup;
+	// Environment tasks start with
+	char **envp;
+	char *config_filename;
+	struct config config;
+	struct state state;
+	struct state prev_state;
+	// Still listed in utmpx as of the last scan
+	bool present;
+};
+
+extern char **environ;
+
+static struct session **sessions = NULL;
+static size_t sessions_len = 0;
+static size_t sessions_cap = 0;
+static struct timespec utmp_mtime = {0};
+
+
+// Finds the cgroup the session leader is in so tasks are accounted to and
+// limited with the rest of the session.
+static char *
+session_cgroup(pid_t pid)
+{
+	char path[PATH_MAX];
+	char *line = NULL, *cgroup = NULL;
+	size_t line_cap = 0;
+	ssize_t n;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/cgroup", (int)pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return NULL;
+	}
+
+	// The unified hierarchy has hierarchy id 0 and no controllers
+	while ((n = getline(&line, &line_cap, f)) != -1) {
+		int r;
+
+		if (strncmp(line, "0::/", 4) != 0) {
+			continue;
+		}
+		line[strcspn(line, "\n")] = '\0';
+		r = snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cgroup.procs", line + 3);
+		if (r > 0 && (size_t)r < sizeof(path) && access(path, W_OK) == 0) {
+			cgroup = strdup(path);
+		}
+		break;
+	}
+
+	free(line);
+	fclose(f);
+	return cgroup;
+}
+
+static char **
+session_envp(const struct session *s, const struct passwd *pw)
+{
+	char runtime[64];
+	char *vars[9];
+	char **envp = NULL;
+	size_t n = 0, size;
+
+	snprintf(runtime, sizeof(runtime), "/run/user/%u", (unsigned)s->uid);
+
+	if (asprintf(&vars[n++], "HOME=%s", pw->pw_dir) == -1 ||
+			asprintf(&vars[n++], "USER=%s", pw->pw_name) == -1 ||
+			asprintf(&vars[n++], "LOGNAME=%s", pw->pw_name) == -1 ||
+			asprintf(&vars[n++], "SHELL=%s", pw->pw_shell) == -1 ||
+			asprintf(&vars[n++], "PATH=%s", SESSION_PATH) == -1 ||
+			asprintf(&vars[n++], "DISPLAY=%s", s->display) == -1 ||
+			asprintf(&vars[n++], "XAUTHORITY=%s/.Xauthority", pw->pw_dir) == -1) {
+		n--;
+		goto failed;
+	}
+	if (access(runtime, F_OK) == 0 &&
+			asprintf(&vars[n++], "XDG_RUNTIME_DIR=%s", runtime) == -1) {
+		n--;
+		goto failed;
+	}
+
+	// Pack into a single allocation like every other argv and envp
+	size = (n + 1) * sizeof(*envp);
+	for (size_t i = 0; i < n; i++) {
+		size += strlen(vars[i]) + 1;
+	}
+	if ((envp = malloc(size)) != NULL) {
+		char *p = (char *)(envp + n + 1);
+
+		for (size_t i = 0; i < n; i++) {
+			envp[i] = strcpy(p, vars[i]);
+			p += strlen(p) + 1;
+		}
+		envp[n] = NULL;
+	}
+
+failed:
+	while (n > 0) {
+		free(vars[--n]);
+	}
+	return envp;
+}
+
+static void
+session_free(struct session *s)
+{
+	if (s->xss != SIZE_MAX) {
+		xss_remove(s->xss);
+	}
+	config_deinit(&s->config);
+	free(s->display);
+	free(s->groups);
+	free(s->home);
+	free(s->cgroup);
+	free(s->envp);
+	free(s->config_filename);
+	free(s);
+}
+
+// Loads or reloads the user's config. It's parsed with the session's
+// environment so expand_env sees the user's HOME and so on. Plugins are
+// refused while parsing, builtins are left to task_start(), and a missing
+// file simply gives no tasks.
+static void
+session_load(struct session *s)
+{
+	char **saved = environ;
+	struct stat st;
+	bool loaded;
+	FILE *f;
+	int fd;
+
+	// The file is read as root, so it's checked through the descriptor it's
+	// read from: a symlink or FIFO can't be swapped in after the checks.
+	if ((fd = open(s->config_filename,
+					O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC)) == -1) {
+		if (errno == ELOOP) {
+			log_warn("session: ignoring %s, it's a symlink", s->config_filename);
+		} else if (errno != ENOENT) {
+			log_warn("session: failed to open %s:", s->config_filename);
+		}
+		return;
+	}
+	if (fstat(fd, &st) == -1) {
+		log_warn("session: failed to stat %s:", s->config_filename);
+		close(fd);
+		return;
+	}
+	// Don't read anything the user couldn't have written themselves
+	if (!S_ISREG(st.st_mode) || st.st_uid != s->uid ||
+			(st.st_mode & (S_IWGRP | S_IWOTH))) {
+		log_warn("session: ignoring %s, not a file owned by the user or writable by others",
+				s->config_filename);
+		close(fd);
+		return;
+	}
+	if ((f = fdopen(fd, "r")) == NULL) {
+		log_warn("session: failed to open %s:", s->config_filename);
+		close(fd);
+		return;
+	}
+
+	environ = s->envp;
+	loaded = config_reload_user(&s->config, f, s->config_filename);
+	environ = saved;
+	fclose(f);
+	if (!loaded) {
+		return;
+	}
+
+	for (size_t i = 0; i < s->config.tasks.len; i++) {
+		struct task *task = &s->config.tasks.entries[i];
+		struct taskinfo *info = &s->config.tasks.info[task->id];
+
+		// Every task of a session is bound to the session's display
+		task->display = s->xss + 1;
+		info->session = s;
+		if (info->envp == NULL && (info->envp = argv_dup(s->envp)) == NULL) {
+			log_error("session: failed to build environment for task '%s'", info->name);
+		}
+	}
+}
+
+static struct session *
+session_new(const struct utmpx *ut, const char *display)
+{
+	struct session *s;
+	struct passwd *pw;
+	char user[sizeof(ut->ut_user) + 1];
+	char xauthority[PATH_MAX];
+
+	memcpy(user, ut->ut_user, sizeof(ut->ut_user));
+	user[sizeof(ut->ut_user)] = '\0';
+
+	if ((pw = getpwnam(user)) == NULL) {
+		log_warn("session: unknown user '%s' on display '%s'", user, display);
+		return NULL;
+	}
+
+	if ((s = calloc(1, sizeof(*s))) == NULL) {
+		log_error("session: calloc failed:");
+		return NULL;
+	}
+	s->config = (struct config)CONFIG_INIT;
+	s->xss = SIZE_MAX;
+	s->uid = pw->pw_uid;
+	s->gid = pw->pw_gid;
+
+	if ((s->display = strdup(display)) == NULL || (s->home = strdup(pw->pw_dir)) == NULL ||
+			asprintf(&s->config_filename, "%s/.config/idlemon.conf", pw->pw_dir) == -1) {
+		s->config_filename = NULL;
+		log_error("session: out of memory");
+		goto failed;
+	}
+
+	// Resolve the groups now, NSS lookups aren't safe after fork()
+	s->groups_len = 16;
+	for (;;) {
+		int n = s->groups_len;
+		gid_t *groups = realloc(s->groups, n * sizeof(*groups));
+
+		if (groups == NULL) {
+			log_error("session: out of memory");
+			goto failed;
+		}
+		s->groups = groups;
+		if (getgrouplist(pw->pw_name, pw->pw_gid, s->groups, &s->groups_len) != -1) {
+			break;
+		}
+		if (s->groups_len <= n) {
+			s->groups_len = n * 2;
+		}
+	}
+
+	if ((s->envp = session_envp(s, pw)) == NULL) {
+		log_error("session: failed to build environment for '%s'", user);
+		goto failed;
+	}
+	s->cgroup = session_cgroup(ut->ut_pid);
+
+	snprintf(xauthority, sizeof(xauthority), "%s/.Xauthority", pw->pw_dir);
+	if ((s->xss = xss_add(display, xauthority)) == SIZE_MAX) {
+		goto failed;
+	}
+	if (s->xss >= UINT16_MAX) {
+		log_error("session: too many displays");
+		goto failed;
+	}
+
+	log_info("session: added '%s' on display '%s'", user, display);
+	session_load(s);
+	return s;
+
+failed:
+	session_free(s);
+	return NULL;
+}
+
+// Returns the X display of a utmpx entry, or NULL if it isn't an X session
+// that's still alive.
+static const char *
+utmpx_display(const struct utmpx *ut, char *buf, size_t len)
+{
+	const char *src;
+	size_t n;
+
+	if (ut->ut_type != USER_PROCESS) {
+		return NULL;
+	}
+	// Display managers put the display in either field
+	if (ut->ut_host[0] == ':') {
+		src = ut->ut_host;
+		n = strnlen(ut->ut_host, sizeof(ut->ut_host));
+	} else if (ut->ut_line[0] == ':') {
+		src = ut->ut_line;
+		n = strnlen(ut->ut_line, sizeof(ut->ut_line));
+	} else {
+		return NULL;
+	}
+	if (n >= len) {
+		return NULL;
+	}
+	// Skip records left behind by sessions that crashed
+	if (ut->ut_pid <= 0 || (kill(ut->ut_pid, 0) == -1 && errno == ESRCH)) {
+		return NULL;
+	}
+
+	memcpy(buf, src, n);
+	buf[n] = '\0';
+	return buf;
+}
+
+static bool
+sessions_append(struct session *s)
+{
+	if (sessions_len >= sessions_cap) {
+		size_t cap = sessions_cap == 0 ? 8 : sessions_cap * 2;
+		struct session **ss = realloc(sessions, cap * sizeof(*ss));
+
+		if (ss == NULL) {
+			return false;
+		}
+		sessions = ss;
+		sessions_cap = cap;
+	}
+	sessions[sessions_len++] = s;
+	return true;
+}
+
+// Brings the sessions in line with utmpx. It's only read again when it has
+// been modified, so this is a single stat() on most ticks.
+void
+sessions_scan(void)
+{
+	struct utmpx *ut;
+	struct stat st;
+
+	if (stat(_PATH_UTMP, &st) == -1) {
+		log_error("session: failed to stat %s:", _PATH_UTMP);
+		return;
+	}
+	if (st.st_mtim.tv_sec == utmp_mtime.tv_sec && st.st_mtim.tv_nsec == utmp_mtime.tv_nsec) {
+		return;
+	}
+	utmp_mtime = st.st_mtim;
+
+	for (size_t i = 0; i < sessions_len; i++) {
+		sessions[i]->present = false;
+	}
+
+	setutxent();
+	while ((ut = getutxent()) != NULL) {
+		char buf[sizeof(ut->ut_host) + 1];
+		const char *display;
+		struct session *s = NULL;
+
+		if ((display = utmpx_display(ut, buf, sizeof(buf))) == NULL) {
+			continue;
+		}
+		// Logged out sessions are only waiting for their tasks, a new
+		// login on the same display gets a session of its own
+		for (size_t i = 0; i < sessions_len; i++) {
+			if (sessions[i]->xss != SIZE_MAX && strcmp(sessions[i]->display, display) == 0) {
+				s = sessions[i];
+				break;
+			}
+		}
+		if (s == NULL) {
+			if ((s = session_new(ut, display)) == NULL) {
+				continue;
+			}
+			if (!sessions_append(s)) {
+				log_error("session: realloc failed:");
+				session_free(s);
+				continue;
+			}
+		}
+		s->present = true;
+	}
+	endutxent();
+
+	// Logged out sessions can't be monitored any more but are kept until
+	// their tasks have been reaped.
+	for (size_t i = 0; i < sessions_len; i++) {
+		struct session *s = sessions[i];
+
+		if (!s->present && s->xss != SIZE_MAX) {
+			log_info("session: removed display '%s'", s->display);
+			xss_remove(s->xss);
+			s->xss = SIZE_MAX;
+		}
+	}
+}
+
+void
+sessions_reload(void)
+{
+	for (size_t i = 0; i < sessions_len; i++) {
+		if (sessions[i]->present) {
+			session_load(sessions[i]);
+		}
+	}
+}
+
+void
+sessions_process(const struct xss *xss)
+{
+	double load[3] = {0};
+	bool load_read = false;
+
+	for (size_t i = 0; i < sessions_len;) {
+		struct session *s = sessions[i];
+		struct tasklist *tasks = &s->config.tasks;
+		bool connected = s->xss != SIZE_MAX && xss_connected(s->xss);
+
+		// A lost display reads as activity and its running tasks are only
+		// reaped, a stalled one keeps its state until it answers again
+		if (connected) {
+			if (!xss[s->xss].stale) {
+				s->state.idle = xss[s->xss].idle;
+				s->state.xss_active = xss[s->xss].active;
+			}
+		} else {
+			s->state.idle = 0;
+			s->state.xss_active = false;
+		}
+		activity_update(&s->state, &s->prev_state, &s->config);
+		power_get(&s->state, s->config.expr_inputs & EXPR_LID);
+		// Read at most once per tick however many sessions need it
+		if (s->config.expr_inputs & EXPR_LOAD) {
+			if (!load_read && !expr_load(load)) {
+				memset(load, 0, sizeof(load));
+			}
+			load_read = true;
+			memcpy(s->state.load, load, sizeof(load));
+		}
+
+		for (size_t j = 0; j < tasks->len;) {
+			if (!connected && tasks->entries[j].state != TASK_STARTED) {
+				j++;
+			} else if (task_process(tasks, j, s->config.jobs, &s->state, &s->prev_state)) {
+				log_debug("removed temporary task '%s'",
+						tasks->info[tasks->entries[j].id].name);
+				tasklist_remove(tasks, j);
+			} else {
+				j++;
+			}
+		}
+		s->prev_state = s->state;
+
+		if (s->xss == SIZE_MAX && tasks->running == 0) {
+			session_free(s);
+			sessions[i] = sessions[--sessions_len];
+		} else {
+			i++;
+		}
+	}
+}
+
+void
+sessions_deinit(void)
+{
+	for (size_t i = 0; i < sessions_len; i++) {
+		session_free(sessions[i]);
+	}
+	free(sessions);
+	sessions = NULL;
+	sessions_len = 0;
+	sessions_cap = 0;
+}
+
+// Called in the child of a task before exec to take on the session's user.
+// Only async-signal-safe calls are allowed here.
+bool
+session_enter(const struct session *s)
+{
+	int fd;
+
+	// Best effort, tasks still run if the cgroup can't be joined
+	if (s->cgroup != NULL && (fd = open(s->cgroup, O_WRONLY | O_CLOEXEC)) != -1) {
+		ssize_t r = write(fd, "0", 1);
+		(void)r;
+		close(fd);
+	}
+
+	if (setgroups(s->groups_len, s->groups) == -1 || setgid(s->gid) == -1 ||
+			setuid(s->uid) == -1) {
+		return false;
+	}
+	if (chdir(s->home) == -1 && chdir("/") == -1) {
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,211 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "idlemon.h"
+#include "idlemon-status.h"
+
+
+static struct idlemon_status *page = NULL;
+static char page_name[32];
+
+
+static bool
+status_name(char *buf, size_t len)
+{
+	int r = snprintf(buf, len, IDLEMON_STATUS_NAME_FMT, (unsigned)getuid());
+	return r >= 0 && (size_t)r < len;
+}
+
+bool
+status_init(void)
+{
+	int fd;
+
+	if (!status_name(page_name, sizeof(page_name))) {
+		log_error("status: name overflow");
+		return false;
+	}
+
+	if ((fd = shm_open(page_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+		log_error("status: failed to open %s:", page_name);
+		return false;
+	}
+	if (ftruncate(fd, sizeof(*page)) == -1) {
+		log_error("status: failed to resize %s:", page_name);
+		close(fd);
+		return false;
+	}
+
+	page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED) {
+		log_error("status: mmap failed:");
+		page = NULL;
+		return false;
+	}
+
+	// Readers check the magic before the sequence so it's written last
+	memset(page, 0, sizeof(*page));
+	page->version = IDLEMON_STATUS_VERSION;
+	page->pid = getpid();
+	__atomic_store_n(&page->magic, IDLEMON_STATUS_MAGIC, __ATOMIC_RELEASE);
+
+	log_debug("status: publishing to %s", page_name);
+	return true;
+}
+
+void
+status_deinit(void)
+{
+	if (page == NULL) {
+		return;
+	}
+	munmap(page, sizeof(*page));
+	shm_unlink(page_name);
+	page = NULL;
+}
+
+void
+status_update(const struct state *state, const struct tasklist *tasks)
+{
+	uint32_t seq;
+	size_t n;
+
+	if (page == NULL) {
+		return;
+	}
+
+	// Seqlock write side: readers retry while seq is odd or has changed.
+	seq = page->seq;
+	__atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	page->updated = time(NULL);
+	page->idle = state->idle;
+	page->xss_active = state->xss_active;
+	page->suppressed_resets = state->suppressed;
+	page->xss_stalls = xss_stalls() > UINT32_MAX ? UINT32_MAX : xss_stalls();
+
+	n = tasks->len < IDLEMON_STATUS_MAX_TASKS ? tasks->len : IDLEMON_STATUS_MAX_TASKS;
+	for (size_t i = 0; i < n; i++) {
+		const struct task *task = &tasks->entries[i];
+		const struct taskinfo *info = &tasks->info[task->id];
+		struct idlemon_status_task *t = &page->tasks[i];
+
+		strncpy(t->name, info->name, sizeof(t->name) - 1);
+		t->name[sizeof(t->name) - 1] = '\0';
+		t->state = task->state;
+		t->flags = (task->flags & TASK_FAILED ? IDLEMON_STATUS_FAILED : 0) |
+			(task->flags & TASK_TEMPORARY ? IDLEMON_STATUS_TEMPORARY : 0);
+		// Plugins keep a job id rather than a pid
+		t->pid = task->state == TASK_STARTED && !(task->flags & TASK_PLUGIN) ? task->pid : 0;
+		t->last_start = info->last_start;
+		t->last_exit = info->last_exit;
+		t->avoided = info->stats.avoided > UINT32_MAX ? UINT32_MAX : info->stats.avoided;
+		t->runs = info->stats.runs;
+		t->wall_ms = info->stats.wall_ms;
+		t->user_us = info->stats.user_us;
+		t->sys_us = info->stats.sys_us;
+		t->inblock = info->stats.inblock;
+		t->oublock = info->stats.oublock;
+		t->max_rss_kb = info->stats.max_rss_kb;
+		t->p50_ms = info->stats.p50_ms;
+		t->p99_ms = info->stats.p99_ms;
+	}
+	page->tasks_len = n;
+	page->tasks_total = tasks->len;
+
+	__atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void
+print_time(const char *label, int64_t t)
+{
+	char buf[32];
+	struct tm tm;
+	time_t tt = t;
+
+	if (t == 0 || localtime_r(&tt, &tm) == NULL ||
+			strftime(buf, sizeof(buf), "%Y-%m-%dT%T%z", &tm) == 0) {
+		printf("  %-10s -\n", label);
+	} else {
+		printf("  %-10s %s\n", label, buf);
+	}
+}
+
+int
+status_print(void)
+{
+	static const char *states[] = {
+		[IDLEMON_STATUS_PENDING] = "pending",
+		[IDLEMON_STATUS_STARTED] = "started",
+		[IDLEMON_STATUS_COMPLETED] = "completed",
+	};
+	struct idlemon_status status;
+	const struct idlemon_status *p;
+	char name[32];
+	int fd;
+
+	if (!status_name(name, sizeof(name))) {
+		log_fatal("status: name overflow");
+	}
+	if ((fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0)) == -1) {
+		log_fatal("status: failed to open %s:", name);
+	}
+	p = mmap(NULL, sizeof(*p), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		log_fatal("status: mmap failed:");
+	}
+
+	if (!idlemon_status_read(p, &status)) {
+		log_fatal("status: incompatible status page %s", name);
+	}
+	munmap((void *)p, sizeof(*p));
+
+	printf("pid:        %d\n", (int)status.pid);
+	printf("idle:       %llu ms\n", (unsigned long long)status.idle);
+	printf("xss_active: %s\n", status.xss_active ? "true" : "false");
+	printf("suppressed: %u resets\n", (unsigned)status.suppressed_resets);
+	printf("stalls:     %u\n", (unsigned)status.xss_stalls);
+
+	for (uint32_t i = 0; i < status.tasks_len; i++) {
+		const struct idlemon_status_task *t = &status.tasks[i];
+
+		printf("\n[%s]\n", t->name);
+		printf("  %-10s %s%s%s\n", "state",
+				t->state <= IDLEMON_STATUS_COMPLETED ? states[t->state] : "unknown",
+				t->flags & IDLEMON_STATUS_FAILED ? ", failed" : "",
+				t->flags & IDLEMON_STATUS_TEMPORARY ? ", removed" : "");
+		if (t->pid != 0) {
+			printf("  %-10s %d\n", "pid", (int)t->pid);
+		}
+		print_time("last_start", t->last_start);
+		print_time("last_exit", t->last_exit);
+		if (t->avoided != 0) {
+			printf("  %-10s %u\n", "avoided", (unsigned)t->avoided);
+		}
+		if (t->runs != 0) {
+			printf("  %-10s %llu, %llu ms in total\n", "runs",
+					(unsigned long long)t->runs, (unsigned long long)t->wall_ms);
+			printf("  %-10s p50 %u ms, p99 %u ms\n", "duration",
+					(unsigned)t->p50_ms, (unsigned)t->p99_ms);
+			printf("  %-10s %.2fs user, %.2fs sys\n", "cpu",
+					t->user_us / 1e6, t->sys_us / 1e6);
+			printf("  %-10s %llu KiB\n", "max_rss", (unsigned long long)t->max_rss_kb);
+			printf("  %-10s %llu/%llu blocks in/out\n", "io",
+					(unsigned long long)t->inblock, (unsigned long long)t->oublock);
+		}
+	}
+
+	if (status.tasks_total > status.tasks_len) {
+		printf("\n(%u more tasks not shown)\n", status.tasks_total - status.tasks_len);
+	}
+	return 0;
+}
@@ -1,59 +1,583 @@
+// wait4(), pipe2()
+#define _GNU_SOURCE
 
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "idlemon.h"
+#include "trace.h"
 
+// Search path used by execvp() when PATH isn't set
+#define DEFAULT_PATH "/bin:/usr/bin"
 
+// Longest pause in a run of activity when only min_inputs is set
+#define ACTIVITY_WINDOW 60000
+
+extern char **environ;
+
+
+static const char *
+env_get(char *const *envp, const char *name)
+{
+	size_t len = strlen(name);
+
+	for (char *const *e = envp; *e != NULL; e++) {
+		if (strncmp(*e, name, len) == 0 && (*e)[len] == '=') {
+			return *e + len + 1;
+		}
+	}
+	return NULL;
+}
+
+static uint64_t
+hash_str(const char *s)
+{
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325;
+
+	for (; *s != '\0'; s++) {
+		h = (h ^ (unsigned char)*s) * 0x100000001b3;
+	}
+	return h;
+}
+
+static bool
+is_executable(const char *path)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0;
+}
+
+// Resolves name against PATH like execvp() would. The result is cached with
+// the hash of PATH so launching doesn't search again unless it changes.
+static bool
+resolve(const char *name, char *const *envp, char **path, uint64_t *path_hash)
+{
+	const char *search, *dir, *end;
+	char buf[PATH_MAX];
+	uint64_t hash;
+
+	if (strchr(name, '/') != NULL) {
+		if (*path == NULL && (*path = strdup(name)) == NULL) {
+			return false;
+		}
+		return true;
+	}
+
+	search = envp != NULL ? env_get(envp, "PATH") : getenv("PATH");
+	if (search == NULL) {
+		search = DEFAULT_PATH;
+	}
+
+	hash = hash_str(search);
+	if (*path != NULL && *path_hash == hash) {
+		return true;
+	}
+
+	free(*path);
+	*path = NULL;
+	*path_hash = hash;
+
+	for (dir = search; ; dir = end + 1) {
+		int r;
+
+		if ((end = strchr(dir, ':')) == NULL) {
+			end = dir + strlen(dir);
+		}
+
+		// An empty entry means the current directory
+		r = end == dir
+			? snprintf(buf, sizeof(buf), "%s", name)
+			: snprintf(buf, sizeof(buf), "%.*s/%s", (int)(end - dir), dir, name);
+
+		if (r > 0 && (size_t)r < sizeof(buf) && is_executable(buf)) {
+			*path = strdup(buf);
+			return *path != NULL;
+		}
+
+		if (*end == '\0') {
+			return false;
+		}
+	}
+}
+
+// Resolves the program of the task, or of each stage of a pipeline.
+bool
+task_resolve(struct taskinfo *info)
+{
+	if (info->stages_len == 0) {
+		return resolve(info->argv[0], info->envp, &info->path, &info->path_hash);
+	}
+	for (size_t i = 0; i < info->stages_len; i++) {
+		struct stage *stage = &info->stages[i];
+
+		if (!resolve(stage->argv[0], info->envp, &stage->path, &stage->path_hash)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Runs in the forked child, the exit codes are told apart by task_wait().
+__attribute__((noreturn))
 static void
-task_start(struct task *task)
+task_exec(const struct taskinfo *info, const char *path, char *const *argv)
 {
+	if (info->session != NULL && !session_enter(info->session)) {
+		_exit(252);
+	}
+	if (info->cwd != NULL && chdir(info->cwd) == -1) {
+		_exit(253);
+	}
+	execve(path, argv, info->envp != NULL ? info->envp : environ);
+	_exit(errno == ENOENT ? 254 : 255);
+}
+
+// Starts every stage of a pipeline, each reading the output of the one
+// before. The output of the captured stage goes straight to the capture file
+// when it's the last stage, otherwise a pump tees it into the next stage and
+// the file. The pump is set up first, so a pipeline whose output can't be
+// captured isn't started at all. Returns false if no stage could be started.
+static bool
+task_start_pipeline(struct task *task, struct taskinfo *info)
+{
+	int in = -1, capture = -1, pump_write = -1, pump_read = -1;
+	size_t started = 0;
+
+	if (info->capture != NULL) {
+		// splice() can't write to files opened for appending, the pump
+		// starts at the end instead
+		bool pumped = info->capture_stage < info->stages_len;
+		int a[2], b[2];
+
+		if ((capture = open(info->capture, O_WRONLY | O_CREAT | O_CLOEXEC |
+						(pumped ? 0 : O_APPEND), 0644)) == -1 ||
+				(pumped && lseek(capture, 0, SEEK_END) == -1)) {
+			log_error("task: [%s] failed to open %s:", info->name, info->capture);
+			if (capture != -1) {
+				close(capture);
+			}
+			return false;
+		}
+
+		if (pumped) {
+			if (pipe2(a, O_CLOEXEC) == -1) {
+				log_error("task: [%s] pipe failed:", info->name);
+				close(capture);
+				return false;
+			}
+			if (pipe2(b, O_CLOEXEC) == -1) {
+				log_error("task: [%s] pipe failed:", info->name);
+				close(a[0]);
+				close(a[1]);
+				close(capture);
+				return false;
+			}
+			// The pump takes over the capture file
+			if ((info->pump = pump_add(a[0], b[1], capture)) == 0) {
+				close(a[0]);
+				close(a[1]);
+				close(b[0]);
+				close(b[1]);
+				close(capture);
+				return false;
+			}
+			capture = -1;
+			pump_write = a[1];
+			pump_read = b[0];
+		}
+	}
+
+	for (size_t i = 0; i < info->stages_len; i++) {
+		struct stage *stage = &info->stages[i];
+		int out = -1, next_in = -1;
+		int fds[2];
+		pid_t pid;
+
+		if (pump_write != -1 && info->capture_stage == i + 1) {
+			out = pump_write;
+			next_in = pump_read;
+			pump_write = -1;
+			pump_read = -1;
+		} else if (i + 1 < info->stages_len) {
+			if (pipe2(fds, O_CLOEXEC) == -1) {
+				log_error("task: [%s] pipe failed:", info->name);
+				break;
+			}
+			out = fds[1];
+			next_in = fds[0];
+		} else if (capture != -1) {
+			out = capture;
+		}
+
+		if ((pid = fork()) == -1) {
+			log_fatal("task: [%s] fork failed:", info->name);
+		} else if (pid == 0) {
+			if ((in != -1 && dup2(in, STDIN_FILENO) == -1) ||
+					(out != -1 && dup2(out, STDOUT_FILENO) == -1)) {
+				_exit(255);
+			}
+			task_exec(info, stage->path, stage->argv);
+		}
+
+		stage->pid = pid;
+		started++;
+		if (in != -1) {
+			close(in);
+		}
+		if (out != -1 && out != capture) {
+			close(out);
+		}
+		in = next_in;
+	}
+
+	if (in != -1) {
+		close(in);
+	}
+	// Not reached when a stage before the captured one failed to start, the
+	// pump then sees the end of its input and finishes
+	if (pump_write != -1) {
+		close(pump_write);
+		close(pump_read);
+	}
+	if (capture != -1) {
+		close(capture);
+	}
+
+	// Stages left out read or write a closed pipe and finish, the task
+	// still counts as failed.
+	if (started < info->stages_len) {
+		task->flags |= TASK_FAILED;
+	}
+	if (started == 0) {
+		if (info->pump != 0) {
+			pump_free(info->pump);
+			info->pump = 0;
+		}
+		return false;
+	}
+	task->pid = info->stages[started - 1].pid;
+	return true;
+}
+
+static void
+task_start(struct task *task, struct taskinfo *info)
+{
+	uint64_t t = trace_now();
 	pid_t pid;
 
+	info->last_start = time(NULL);
+	info->stats.started = t;
+	task->flags &= ~TASK_HELD;
+
+	if (!(task->flags & (TASK_BUILTIN | TASK_PLUGIN)) && !task_resolve(info)) {
+		log_error("task: [%s] not found", info->name);
+		task->state = TASK_COMPLETED;
+		task->flags |= TASK_FAILED;
+		info->last_exit = info->last_start;
+		return;
+	}
+
+	// Builtins and plugins run inside idlemon and it opens capture files, so
+	// as root when monitoring system wide. Only let users turn their own
+	// display off.
+	if ((((task->flags & TASK_BUILTIN) && info->builtin != BUILTIN_DPMS) ||
+			(task->flags & TASK_PLUGIN) || info->capture != NULL) &&
+			info->session != NULL) {
+		log_error("task: [%s] not available system wide", info->name);
+		task->state = TASK_COMPLETED;
+		task->flags |= TASK_FAILED;
+		info->last_exit = info->last_start;
+		return;
+	}
+
+	if (task->flags & TASK_BUILTIN) {
+		log_info("task: [%s] started", info->name);
+		task->pid = 0;
+		task->state = TASK_STARTED;
+		if (!builtin_run(task, info)) {
+			task->flags |= TASK_FAILED;
+		}
+		TRACE(TASK_START, task->id, 0, trace_now() - t);
+		return;
+	}
+
+	if (task->flags & TASK_PLUGIN) {
+		long id = plugin_start(info);
+
+		if (id == -1) {
+			task->state = TASK_COMPLETED;
+			task->flags |= TASK_FAILED;
+			info->last_exit = info->last_start;
+			return;
+		}
+		log_info("task: [%s] started", info->name);
+		task->pid = id;
+		task->state = TASK_STARTED;
+		TRACE(TASK_START, task->id, 0, trace_now() - t);
+		return;
+	}
+
+	if (task->flags & TASK_PIPELINE) {
+		if (!task_start_pipeline(task, info)) {
+			task->state = TASK_COMPLETED;
+			task->flags |= TASK_FAILED;
+			info->last_exit = info->last_start;
+			return;
+		}
+		log_info("task: [%s] started %zu stages", info->name, info->stages_len);
+		task->state = TASK_STARTED;
+		TRACE(TASK_START, task->id, task->pid, trace_now() - t);
+		return;
+	}
+
 	if ((pid = fork()) == -1) {
-		log_fatal("task: [%s] fork failed:", task->name);
+		log_fatal("task: [%s] fork failed:", info->name);
 		return;
 	} else if (pid > 0) {
-		log_info("task: [%s] started", task->name);
+		log_info("task: [%s] started", info->name);
 		task->pid = pid;
 		task->state = TASK_STARTED;
+		TRACE(TASK_START, task->id, pid, trace_now() - t);
 		return;
 	}
 
-	execvp(task->argv[0], task->argv);
-	_exit(errno == ENOENT ? 254 : 255);
+	task_exec(info, info->path, info->argv);
 }
 
+// Insertion sort rather than qsort(), which may allocate
+static void
+sort_durations(uint32_t *d, size_t n)
+{
+	for (size_t i = 1; i < n; i++) {
+		uint32_t x = d[i];
+		size_t j = i;
+
+		for (; j > 0 && d[j - 1] > x; j--) {
+			d[j] = d[j - 1];
+		}
+		d[j] = x;
+	}
+}
+
+// Adds the usage of a reaped process to the task's totals.
+static void
+task_usage(struct taskinfo *info, const struct rusage *ru)
+{
+	struct taskstats *st = &info->stats;
+
+	st->user_us += ru->ru_utime.tv_sec * 1000000ULL + ru->ru_utime.tv_usec;
+	st->sys_us += ru->ru_stime.tv_sec * 1000000ULL + ru->ru_stime.tv_usec;
+	st->inblock += ru->ru_inblock;
+	st->oublock += ru->ru_oublock;
+	// In KiB on Linux
+	if ((uint64_t)ru->ru_maxrss > st->max_rss_kb) {
+		st->max_rss_kb = ru->ru_maxrss;
+	}
+}
+
+// Adds a finished run to the task's stats. ru is NULL for builtins and
+// plugins, whose usage can't be told apart from idlemon's own.
+static void
+task_account(struct taskinfo *info, const struct rusage *ru)
+{
+	struct taskstats *st = &info->stats;
+
+	st->runs++;
+
+	if (ru != NULL) {
+		task_usage(info, ru);
+		log_info("task: [%s] used %.2fs user, %.2fs sys, %ld KiB max rss, "
+				"%ld/%ld blocks in/out", info->name, ru->ru_utime.tv_sec +
+				ru->ru_utime.tv_usec / 1e6, ru->ru_stime.tv_sec +
+				ru->ru_stime.tv_usec / 1e6, ru->ru_maxrss, ru->ru_inblock,
+				ru->ru_oublock);
+	}
+
+	// Unknown for runs handed over by an upgrade
+	if (st->started != 0) {
+		uint64_t ms = (trace_now() - st->started) / 1000000;
+		uint32_t sorted[TASK_STATS_RUNS];
+		size_t n;
+
+		st->started = 0;
+		st->wall_ms += ms;
+		st->durations[st->durations_next] = ms > UINT32_MAX ? UINT32_MAX : ms;
+		st->durations_next = (st->durations_next + 1) % TASK_STATS_RUNS;
+		if (st->durations_len < TASK_STATS_RUNS) {
+			st->durations_len++;
+		}
+
+		// Nearest rank, a copy of at most TASK_STATS_RUNS is cheap to sort
+		n = st->durations_len;
+		memcpy(sorted, st->durations, n * sizeof(*sorted));
+		sort_durations(sorted, n);
+		st->p50_ms = sorted[(n * 50 + 99) / 100 - 1];
+		st->p99_ms = sorted[(n * 99 + 99) / 100 - 1];
+
+		log_debug("task: [%s] took %llu ms, p50 %u ms, p99 %u ms over %zu runs",
+				info->name, (unsigned long long)ms, (unsigned)st->p50_ms,
+				(unsigned)st->p99_ms, n);
+	}
+}
+
+// Reaps the stages of a pipeline as they exit, reporting on each. The
+// pipeline completes once all of them have, failing if any did.
 static bool
-task_wait(struct task *task)
+task_wait_pipeline(struct task *task, struct taskinfo *info)
 {
+	bool done = true;
+
+	for (size_t i = 0; i < info->stages_len; i++) {
+		struct stage *stage = &info->stages[i];
+		struct rusage ru;
+		int status;
+
+		if (stage->pid == 0) {
+			continue;
+		}
+		switch (wait4(stage->pid, &status, WNOHANG, &ru)) {
+		case -1:
+			log_error("task: [%s] wait4 failed for stage %zu:", info->name, i + 1);
+			task->flags |= TASK_FAILED;
+			stage->pid = 0;
+			continue;
+		case 0:
+			done = false;
+			continue;
+		}
+		TRACE(TASK_EXIT, task->id, stage->pid, status);
+		stage->pid = 0;
+		task_usage(info, &ru);
+
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			log_info("task: [%s] stage %zu (%s) finished after %llu ms, %.2fs user, "
+					"%.2fs sys", info->name, i + 1, stage->argv[0],
+					(unsigned long long)((trace_now() - info->stats.started) / 1000000),
+					ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+					ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+			continue;
+		}
+		// Its reader finished early, which is up to the reader to report
+		if (WIFSIGNALED(status) && WTERMSIG(status) == SIGPIPE) {
+			log_debug("task: [%s] stage %zu (%s) stopped as its output was closed",
+					info->name, i + 1, stage->argv[0]);
+			continue;
+		}
+		task->flags |= TASK_FAILED;
+		if (WIFSIGNALED(status)) {
+			log_warn("task: [%s] stage %zu (%s) received signal (%d)", info->name,
+					i + 1, stage->argv[0], WTERMSIG(status));
+		} else if (WEXITSTATUS(status) == 254) {
+			log_error("task: [%s] stage %zu (%s) not found", info->name, i + 1,
+					stage->argv[0]);
+		} else {
+			log_error("task: [%s] stage %zu (%s) exited with non-zero status (%d)",
+					info->name, i + 1, stage->argv[0], WEXITSTATUS(status));
+		}
+	}
+
+	if (info->pump != 0) {
+		if (!pump_done(info->pump)) {
+			return false;
+		}
+		pump_free(info->pump);
+		info->pump = 0;
+	}
+	if (!done) {
+		return false;
+	}
+
+	info->last_exit = time(NULL);
+	task_account(info, NULL);
+	task->state = TASK_COMPLETED;
+	return true;
+}
+
+static bool
+task_wait(struct task *task, struct taskinfo *info)
+{
+	struct rusage ru;
 	int status = 0;
 
-	switch (waitpid(task->pid, &status, WNOHANG)) {
+	// builtins have already finished in task_start()
+	if (task->flags & TASK_BUILTIN) {
+		task->state = TASK_COMPLETED;
+		info->last_exit = time(NULL);
+		task_account(info, NULL);
+		return true;
+	}
+
+	if (task->flags & TASK_PLUGIN) {
+		if (!plugin_wait(task->pid, &status)) {
+			return false;
+		}
+		info->last_exit = time(NULL);
+		TRACE(TASK_EXIT, task->id, 0, status);
+		task_account(info, NULL);
+		task->state = TASK_COMPLETED;
+		if (status != 0) {
+			log_error("task: [%s] plugin failed (%d)", info->name, status);
+			task->flags |= TASK_FAILED;
+		}
+		return true;
+	}
+
+	if (task->flags & TASK_PIPELINE) {
+		return task_wait_pipeline(task, info);
+	}
+
+	switch (wait4(task->pid, &status, WNOHANG, &ru)) {
 	case -1:
-		log_error("task: [%s] waitpid failed:", task->name);
+		log_error("task: [%s] wait4 failed:", info->name);
 		task->state = TASK_COMPLETED;
+		task->flags |= TASK_FAILED;
+		info->last_exit = time(NULL);
 		return true;
 	case 0:
 		return false;
 	}
 
+	info->last_exit = time(NULL);
+	TRACE(TASK_EXIT, task->id, task->pid, status);
+	task_account(info, &ru);
+
+	task->flags |= TASK_FAILED;
+
 	if (WIFEXITED(status)) {
 		int code = WEXITSTATUS(status);
 		switch (code) {
 		case 255:
-			log_error("task: [%s] failed to start", task->name);
+			log_error("task: [%s] failed to start", info->name);
 			break;
 		case 254:
-			log_error("task: [%s] not found", task->name);
+			log_error("task: [%s] not found", info->name);
+			break;
+		case 253:
+			log_error("task: [%s] failed to change directory to %s",
+					info->name, info->cwd);
+			break;
+		case 252:
+			log_error("task: [%s] failed to switch to the session user", info->name);
 			break;
 		default:
 			if (code != 0) {
 				log_error("task: [%s] exited with non-zero status (%d)",
-						task->name, code);
+						info->name, code);
+			} else {
+				task->flags &= ~TASK_FAILED;
 			}
 			break;
 		}
@@ -63,7 +587,7 @@ task_wait(struct task *task)
 
 	if (WIFSIGNALED(status)) {
 		int sig = WTERMSIG(status);
-		log_warn("task: [%s] received signal (%d)", task->name, sig);
+		log_warn("task: [%s] received signal (%d)", info->name, sig);
 		task->state = TASK_COMPLETED;
 		return true;
 	}
@@ -72,80 +596,269 @@ task_wait(struct task *task)
 }
 
 static void
-task_reset(struct task *task)
+task_reset(struct task *task, const struct taskinfo *info)
 {
-	log_debug("task: [%s] reset", task->name);
+	log_debug("task: [%s] reset", info->name);
 	task->state = TASK_PENDING;
+	task->flags &= ~TASK_FAILED;
+}
+
+// Whether a task should go back to pending, or be cancelled if it's a running
+// plugin.
+static bool
+task_reset_due(const struct tasklist *list, const struct task *task,
+		const struct state *state, const struct state *prev_state)
+{
+	if (task->flags & TASK_RESET_EXPR) {
+		return expr_eval(list->info[task->id].reset, state);
+	} else if (task->delay == TASK_DELAY_XSS && !(task->flags & TASK_START_EXPR)) {
+		return state->xss_active != prev_state->xss_active;
+	}
+	return state->active;
+}
+
+// Decides whether input on this tick ends the idle period. Without min_active
+// and min_inputs any input does. Otherwise input has to keep coming, with no
+// pause as long as min_active (or ACTIVITY_WINDOW), until it has lasted
+// min_active or was seen on min_inputs ticks. A mouse nudged by accident then
+// doesn't reset every task.
+void
+activity_update(struct state *state, const struct state *prev_state,
+		const struct config *cfg)
+{
+	unsigned long pause = cfg->min_active > 0 ? cfg->min_active : ACTIVITY_WINDOW;
+	uint64_t now = trace_now() / 1000000;
+
+	state->active = false;
+
+	if (state->idle >= prev_state->idle) {
+		if (state->inputs > 0 && state->idle >= pause) {
+			if (!state->sustained) {
+				log_debug("activity: ignored %lu ms of activity on %u ticks",
+						(unsigned long)(now - state->idle - state->active_since),
+						(unsigned)state->inputs);
+				state->suppressed++;
+			}
+			state->inputs = 0;
+			state->sustained = false;
+		}
+		return;
+	}
+
+	if (state->inputs++ == 0) {
+		state->active_since = now - state->idle;
+	}
+	if (!state->sustained) {
+		state->sustained = (cfg->min_active == 0 && cfg->min_inputs == 0) ||
+			(cfg->min_active > 0 && now - state->active_since >= cfg->min_active) ||
+			(cfg->min_inputs > 0 && state->inputs >= cfg->min_inputs);
+	}
+	state->active = state->sustained;
+}
+
+// Whether the cooldown or min_interval keep a task from starting again yet.
+static bool
+task_held(struct taskinfo *info)
+{
+	time_t now = time(NULL);
+	time_t last;
+
+	if (info->cooldown > 0 && info->last_exit != 0 &&
+			(unsigned long)(now - info->last_exit) < info->cooldown / 1000) {
+		return true;
+	}
+	if (info->min_interval > 0 && (last = runs_last_start(info)) != 0 &&
+			(unsigned long)(now - last) < info->min_interval / 1000) {
+		return true;
+	}
+	return false;
+}
+
+static enum {
+	DEPS_READY,
+	DEPS_WAITING,
+	DEPS_FAILED,
+} task_deps(const struct tasklist *list, const struct taskinfo *info)
+{
+	for (size_t i = 0; i < info->deps_len; i++) {
+		const struct task *dep = &list->entries[list->slots[info->deps[i]]];
+
+		if (dep->state != TASK_COMPLETED) {
+			return DEPS_WAITING;
+		}
+		if (dep->flags & TASK_FAILED) {
+			return DEPS_FAILED;
+		}
+	}
+	return DEPS_READY;
 }
 
 bool
-task_process(struct task *task, const struct state *state,
-		const struct state *prev_state)
+task_process(struct tasklist *list, size_t i, unsigned long jobs,
+		const struct state *state, const struct state *prev_state)
 {
+	struct task *task = &list->entries[i];
+	struct taskinfo *info;
+
 	switch (task->state) {
 	case TASK_PENDING:
 		{
-			bool start = task->delay == TASK_DELAY_XSS
-				? state->xss_active
-				: state->idle >= task->delay;
+			bool start;
 
-			if (start) {
-				task_start(task);
+			if ((task->flags & TASK_HELD) && state->active) {
+				task->flags &= ~TASK_HELD;
+				list->info[task->id].stats.avoided++;
 			}
-			break;
+
+			if (task->flags & TASK_START_EXPR) {
+				start = expr_eval(list->info[task->id].start, state);
+			} else {
+				start = task->delay == TASK_DELAY_XSS
+					? state->xss_active
+					: state->idle >= task->delay;
+			}
+
+			if (!start || (state->power & task->require) != task->require ||
+					(state->power & task->forbid) != 0) {
+				break;
+			}
+
+			info = &list->info[task->id];
+
+			if (info->min_expected_idle > 0 &&
+					!history_expect(state->idle, info->min_expected_idle)) {
+				break;
+			}
+
+			if (task_held(info)) {
+				if (!(task->flags & TASK_HELD)) {
+					log_debug("task: [%s] held back until it's due again", info->name);
+					task->flags |= TASK_HELD;
+				}
+				break;
+			}
+
+			switch (task_deps(list, info)) {
+			case DEPS_WAITING:
+				break;
+			case DEPS_FAILED:
+				// Mark as failed rather than pending so the failure
+				// propagates to our own dependents.
+				log_warn("task: [%s] skipped as a dependency failed", info->name);
+				task->state = TASK_COMPLETED;
+				task->flags |= TASK_FAILED;
+				break;
+			case DEPS_READY:
+				if (jobs == 0 || list->running < jobs) {
+					task_start(task, info);
+					if (task->state == TASK_STARTED) {
+						list->running++;
+					}
+				}
+				break;
+			}
+
+			if (task->state != TASK_STARTED || !(task->flags & TASK_BUILTIN)) {
+				break;
+			}
+			// builtins complete synchronously so finish them straight away
 		}
+		// fallthrough
 	case TASK_STARTED:
-		if (!task_wait(task)) {
+		info = &list->info[task->id];
+		if (!task_wait(task, info)) {
+			if ((task->flags & TASK_PLUGIN) &&
+					task_reset_due(list, task, state, prev_state)) {
+				log_debug("task: [%s] cancelling", info->name);
+				plugin_cancel(task->pid);
+			}
 			break;
 		}
-		log_info("task: [%s] complete", task->name);
+		list->running--;
+		log_info("task: [%s] complete", info->name);
+		if (!(task->flags & TASK_FAILED)) {
+			runs_record(info);
+		}
 		// waited upon task has completed so we can run completed branch
 		// fallthrough
 	case TASK_COMPLETED:
-		if (task->temporary) {
+		if (task->flags & TASK_TEMPORARY) {
 			return true;
 		} else {
-			bool reset = task->delay == TASK_DELAY_XSS
-				? state->xss_active != prev_state->xss_active
-				: state->idle < prev_state->idle;
-
-			if (reset) {
-				task_reset(task);
+			if (task_reset_due(list, task, state, prev_state)) {
+				TRACE(TASK_RESET, task->id, state->idle, state->xss_active);
+				task_reset(task, &list->info[task->id]);
 			}
 		}
 	}
 	return false;
 }
 
-struct task *
-task_clone(struct task *dst, const struct task *src)
+struct taskinfo *
+task_clone(struct taskinfo *dst, const struct taskinfo *src)
 {
-	size_t argv_len;
-	char **pp;
-
 	memset(dst, 0, sizeof(*dst));
 
 	if ((dst->name = strdup(src->name)) == NULL) {
 		return NULL;
 	}
+	// Removed tasks kept running across an upgrade only have a name
+	if (src->argv != NULL && (dst->argv = argv_dup(src->argv)) == NULL) {
+		goto failed;
+	}
+	if (src->path != NULL && (dst->path = strdup(src->path)) == NULL) {
+		goto failed;
+	}
+	if (src->envp != NULL && (dst->envp = argv_dup(src->envp)) == NULL) {
+		goto failed;
+	}
+	if (src->cwd != NULL && (dst->cwd = strdup(src->cwd)) == NULL) {
+		goto failed;
+	}
+	dst->path_hash = src->path_hash;
 
-	for (pp = src->argv, argv_len = 0; *pp != NULL; pp++, argv_len++) {
+	if (src->start != NULL && (dst->start = expr_dup(src->start)) == NULL) {
+		goto failed;
 	}
-	
-	if ((dst->argv = calloc(argv_len + 1, sizeof(*dst->argv))) == NULL) {
+	if (src->reset != NULL && (dst->reset = expr_dup(src->reset)) == NULL) {
 		goto failed;
 	}
 
-	for (size_t i = 0; i < argv_len; i++) {
-		if ((dst->argv[i] = strdup(src->argv[i])) == NULL) {
+	if (src->plugin_handle != NULL) {
+		// Takes another reference to the already loaded object
+		if ((dst->plugin_handle = dlopen(src->argv[0], RTLD_NOW | RTLD_LOCAL)) == NULL) {
+			goto failed;
+		}
+		dst->plugin = src->plugin;
+	}
+
+	if (src->stages_len > 0) {
+		if ((dst->stages = calloc(src->stages_len, sizeof(*dst->stages))) == NULL) {
 			goto failed;
 		}
+		dst->stages_len = src->stages_len;
+		for (size_t i = 0; i < src->stages_len; i++) {
+			if ((dst->stages[i].argv = argv_dup(src->stages[i].argv)) == NULL ||
+					(src->stages[i].path != NULL &&
+					 (dst->stages[i].path = strdup(src->stages[i].path)) == NULL)) {
+				goto failed;
+			}
+			dst->stages[i].path_hash = src->stages[i].path_hash;
+			dst->stages[i].pid = src->stages[i].pid;
+		}
 	}
+	if (src->capture != NULL && (dst->capture = strdup(src->capture)) == NULL) {
+		goto failed;
+	}
+	dst->capture_stage = src->capture_stage;
+	dst->pump = src->pump;
 
-	dst->delay = src->delay;
-	dst->pid = src->pid;
-	dst->state = src->state;
-	dst->temporary = src->temporary;
+	dst->builtin = src->builtin;
+	dst->session = src->session;
+	dst->last_start = src->last_start;
+	dst->last_exit = src->last_exit;
+	dst->stats = src->stats;
+	dst->run_slot = src->run_slot;
 
 	return dst;
 
@@ -155,22 +868,42 @@ failed:
 }
 
 void
-task_deinit(struct task *task)
+task_deinit(struct taskinfo *info)
 {
-	if (task->name != NULL) {
-		free(task->name);
+	if (info->name != NULL) {
+		free(info->name);
 	}
-	if (task->argv != NULL) {
-		for (char **p = task->argv; *p != NULL; p++) {
-			free(*p);
-		}
-		free(task->argv);
+	if (info->argv != NULL) {
+		free(info->argv);
+	}
+	if (info->after != NULL) {
+		free(info->after);
+	}
+	free(info->path);
+	free(info->envp);
+	free(info->cwd);
+	free(info->env);
+	free(info->start);
+	free(info->reset);
+	for (size_t i = 0; i < info->stages_len; i++) {
+		free(info->stages[i].argv);
+		free(info->stages[i].path);
+	}
+	free(info->stages);
+	free(info->capture);
+	if (info->plugin_handle != NULL) {
+		dlclose(info->plugin_handle);
+	}
+	if (info->deps != NULL) {
+		free(info->deps);
 	}
 }
 
 bool
-tasklist_append(struct tasklist *list, const struct task *task)
+tasklist_append(struct tasklist *list, struct task *task, const struct taskinfo *info)
 {
+	size_t id;
+
 	if (list->len >= list->cap) {
 		size_t cap = list->cap == 0 ? 8 : list->cap * 2;
 		struct task *entries = realloc(list->entries, cap * sizeof(*entries));
@@ -181,6 +914,36 @@ tasklist_append(struct tasklist *list, const struct task *task)
 		list->entries = entries;
 	}
 
+	// Reuse the id of a removed task before growing
+	if (list->info_len > 0 && list->free_id != SIZE_MAX) {
+		id = list->free_id;
+		list->free_id = list->slots[id];
+	} else if (list->info_len < list->info_cap) {
+		id = list->info_len++;
+	} else {
+		size_t cap = list->info_cap == 0 ? 8 : list->info_cap * 2;
+		struct taskinfo *infos;
+		size_t *slots;
+
+		if ((infos = realloc(list->info, cap * sizeof(*infos))) == NULL) {
+			return false;
+		}
+		list->info = infos;
+		if ((slots = realloc(list->slots, cap * sizeof(*slots))) == NULL) {
+			return false;
+		}
+		list->slots = slots;
+
+		if (list->info_cap == 0) {
+			list->free_id = SIZE_MAX;
+		}
+		list->info_cap = cap;
+		id = list->info_len++;
+	}
+
+	task->id = id;
+	memcpy(&list->info[id], info, sizeof(*info));
+	list->slots[id] = list->len;
 	memcpy(&list->entries[list->len++], task, sizeof(*task));
 	return true;
 }
@@ -188,18 +951,37 @@ tasklist_append(struct tasklist *list, const struct task *task)
 void
 tasklist_remove(struct tasklist *list, size_t i)
 {
+	size_t id;
+
 	if (i >= list->len) {
 		return;
 	}
 
-	task_deinit(&list->entries[i]);
+	id = list->entries[i].id;
+	task_deinit(&list->info[id]);
+	memset(&list->info[id], 0, sizeof(list->info[id]));
 
 	if (i != list->len - 1) {
-		// Swap with last entry as we don't care about maintaining order
+		// Swap with last entry as we don't care about maintaining order,
+		// only the small scheduling state moves.
 		memcpy(&list->entries[i], &list->entries[list->len - 1],
 				sizeof(*list->entries));
+		list->slots[list->entries[i].id] = i;
 	}
 
+	list->slots[id] = list->free_id;
+	list->free_id = id;
 	list->len--;
 }
 
+void
+tasklist_deinit(struct tasklist *list)
+{
+	for (size_t i = 0; i < list->len; i++) {
+		task_deinit(&list->info[list->entries[i].id]);
+	}
+	free(list->entries);
+	free(list->info);
+	free(list->slots);
+	memset(list, 0, sizeof(*list));
+}
@@ -0,0 +1,81 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "idlemon.h"
+#include "trace.h"
+
+// Number of events kept, must be a power of two
+#define TRACE_CAP 1024
+
+struct trace_entry {
+	// CLOCK_MONOTONIC in nanoseconds
+	uint64_t time;
+	uint32_t event;
+	uint32_t id;
+	int64_t a;
+	int64_t b;
+};
+
+static struct trace_entry ring[TRACE_CAP];
+// Total number of events ever recorded, the next one goes to
+// ring[head % TRACE_CAP]
+static uint64_t head = 0;
+
+
+uint64_t
+trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void
+trace_record(enum trace_event event, uint32_t id, int64_t a, int64_t b)
+{
+	struct trace_entry *e = &ring[head++ % TRACE_CAP];
+
+	e->time = trace_now();
+	e->event = event;
+	e->id = id;
+	e->a = a;
+	e->b = b;
+}
+
+// Writes the ring to stderr, oldest first, with times relative to now.
+void
+trace_dump(void)
+{
+	static const struct {
+		const char *name, *a, *b;
+	} events[TRACE_EVENTS] = {
+		[TRACE_TICK] = { "tick", "idle", "xss_active" },
+		[TRACE_IDLE_QUERY] = { "idle_query", "ns", "displays" },
+		[TRACE_TASK_START] = { "task_start", "pid", "ns" },
+		[TRACE_TASK_EXIT] = { "task_exit", "pid", "status" },
+		[TRACE_TASK_RESET] = { "task_reset", "idle", "xss_active" },
+		[TRACE_RELOAD] = { "reload", "ns", "ok" },
+	};
+	uint64_t n = head < TRACE_CAP ? head : TRACE_CAP;
+	uint64_t now = trace_now();
+
+	fprintf(stderr, "trace: %llu events, most recent last\n", (unsigned long long)n);
+
+	for (uint64_t i = head - n; i < head; i++) {
+		const struct trace_entry *e = &ring[i % TRACE_CAP];
+		uint64_t ago = now - e->time;
+
+		if (e->event >= TRACE_EVENTS) {
+			continue;
+		}
+		fprintf(stderr, "  -%llu.%06llus %-10s id=%u %s=%lld %s=%lld\n",
+				(unsigned long long)(ago / 1000000000),
+				(unsigned long long)(ago / 1000 % 1000000),
+				events[e->event].name, (unsigned)e->id,
+				events[e->event].a, (long long)e->a,
+				events[e->event].b, (long long)e->b);
+	}
+}
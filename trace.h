@@ -0,0 +1,65 @@
+#ifndef IDLEMON_TRACE_H
+#define IDLEMON_TRACE_H
+
+#include <stdint.h>
+
+enum trace_event {
+	TRACE_TICK,
+	TRACE_IDLE_QUERY,
+	TRACE_TASK_START,
+	TRACE_TASK_EXIT,
+	TRACE_TASK_RESET,
+	TRACE_RELOAD,
+	TRACE_EVENTS,
+};
+
+uint64_t trace_now(void);
+void trace_record(enum trace_event event, uint32_t id, int64_t a, int64_t b);
+void trace_dump(void);
+
+// Static probes in the format of systemtap's <sys/sdt.h>, so they can be
+// attached to with bpftrace or perf without rebuilding, e.g.
+//
+//   bpftrace -e 'usdt:./idlemon:idlemon:TASK_START { printf("%d\n", arg1); }'
+//
+// Each probe site is a single nop plus an ELF note describing where the
+// arguments are. It's written out here rather than including <sys/sdt.h>
+// as that header is often not installed.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+#define TRACE_PROBE3(name, a1, a2, a3) \
+	__asm__ __volatile__ ( \
+		"990: nop\n" \
+		".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+		".balign 4\n" \
+		".4byte 992f-991f, 994f-993f, 3\n" \
+		"991: .asciz \"stapsdt\"\n" \
+		"992: .balign 4\n" \
+		"993: .8byte 990b\n" \
+		".8byte _.stapsdt.base\n" \
+		".8byte 0\n" \
+		".asciz \"idlemon\"\n" \
+		".asciz \"" #name "\"\n" \
+		".asciz \"-8@%0 -8@%1 -8@%2\"\n" \
+		"994: .balign 4\n" \
+		".popsection\n" \
+		".ifndef _.stapsdt.base\n" \
+		".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+		".weak _.stapsdt.base\n" \
+		".hidden _.stapsdt.base\n" \
+		"_.stapsdt.base: .space 1\n" \
+		".size _.stapsdt.base, 1\n" \
+		".popsection\n" \
+		".endif\n" \
+		:: "nor"((int64_t)(a1)), "nor"((int64_t)(a2)), "nor"((int64_t)(a3)))
+#else
+#define TRACE_PROBE3(name, a1, a2, a3) do {} while (0)
+#endif
+
+// Records an event in the trace ring and fires the matching static probe.
+#define TRACE(event, id, a, b) \
+	do { \
+		trace_record(TRACE_##event, (id), (a), (b)); \
+		TRACE_PROBE3(event, (id), (a), (b)); \
+	} while (0)
+
+#endif // IDLEMON_TRACE_H
@@ -0,0 +1,318 @@
+// memfd_create()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "idlemon.h"
+
+// Names the inherited memfd holding the state of the previous process
+#define UPGRADE_ENV "IDLEMON_UPGRADE_FD"
+#define UPGRADE_MAGIC 0x47505549u
+#define UPGRADE_VERSION 1
+
+struct upgrade_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t tasks;
+	uint32_t states;
+	int64_t signal_time;
+};
+
+struct upgrade_state {
+	uint64_t idle;
+	uint8_t xss_active;
+	uint8_t reserved[7];
+};
+
+// Followed by name_len bytes of the task name
+struct upgrade_task {
+	int64_t last_start;
+	int64_t last_exit;
+	int32_t pid;
+	uint8_t state;
+	uint8_t flags;
+	uint16_t name_len;
+};
+
+
+static bool
+write_state(FILE *f, const struct tasklist *tasks, const struct state *states,
+		size_t states_len, time_t signal_time)
+{
+	struct upgrade_header hdr = {
+		.magic = UPGRADE_MAGIC,
+		.version = UPGRADE_VERSION,
+		.tasks = tasks->len,
+		.states = states_len,
+		.signal_time = signal_time,
+	};
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+		return false;
+	}
+
+	for (size_t i = 0; i < states_len; i++) {
+		struct upgrade_state s = {
+			.idle = states[i].idle,
+			.xss_active = states[i].xss_active,
+		};
+
+		if (fwrite(&s, sizeof(s), 1, f) != 1) {
+			return false;
+		}
+	}
+
+	for (size_t i = 0; i < tasks->len; i++) {
+		const struct task *task = &tasks->entries[i];
+		const struct taskinfo *info = &tasks->info[task->id];
+		size_t len = strlen(info->name);
+		// Plugin jobs run on threads that don't survive the exec, they're
+		// cancelled and run again if still due. A started builtin has
+		// already finished, so only running processes are handed over.
+		bool plugin = (task->flags & TASK_PLUGIN) && task->state == TASK_STARTED;
+		bool builtin = (task->flags & TASK_BUILTIN) && task->state == TASK_STARTED;
+		struct upgrade_task t = {
+			.last_start = info->last_start,
+			.last_exit = builtin ? time(NULL) : info->last_exit,
+			.pid = plugin || builtin ? 0 : task->pid,
+			.state = plugin ? TASK_PENDING : builtin ? TASK_COMPLETED : task->state,
+			.flags = task->flags & (TASK_FAILED | TASK_TEMPORARY),
+			.name_len = len > UINT16_MAX ? UINT16_MAX : len,
+		};
+
+		if (fwrite(&t, sizeof(t), 1, f) != 1 ||
+				fwrite(info->name, 1, t.name_len, f) != t.name_len) {
+			return false;
+		}
+	}
+	return fflush(f) == 0;
+}
+
+// Re-executes the binary idlemon was started from with the same arguments,
+// handing over task state in a memfd so the new process carries on where this
+// one left off. As the pid stays the same, running children can still be
+// reaped. Only returns on failure.
+bool
+upgrade_exec(char **argv, const struct state *states, size_t states_len,
+		time_t signal_time)
+{
+	char path[PATH_MAX], env[16];
+	ssize_t len;
+	FILE *f;
+	int fd;
+
+	// Pipes between stages and the pumps copying output don't survive the
+	// exec, so wait for pipelines to finish
+	for (size_t i = 0; i < config.tasks.len; i++) {
+		const struct task *task = &config.tasks.entries[i];
+
+		if ((task->flags & TASK_PIPELINE) && task->state == TASK_STARTED) {
+			log_warn("upgrade: not possible while pipeline '%s' is running",
+					config.tasks.info[task->id].name);
+			return false;
+		}
+	}
+
+	// The binary is usually replaced rather than rewritten, in which case
+	// the link points at the old, deleted file.
+	if ((len = readlink("/proc/self/exe", path, sizeof(path) - 1)) == -1) {
+		log_error("upgrade: failed to read /proc/self/exe:");
+		return false;
+	}
+	path[len] = '\0';
+	if (len > 10 && strcmp(path + len - 10, " (deleted)") == 0) {
+		path[len - 10] = '\0';
+	}
+	if (access(path, X_OK) == -1) {
+		log_error("upgrade: cannot execute %s:", path);
+		return false;
+	}
+
+	// No MFD_CLOEXEC, the new process inherits it
+	if ((fd = memfd_create("idlemon-upgrade", 0)) == -1) {
+		log_error("upgrade: memfd_create failed:");
+		return false;
+	}
+	if ((f = fdopen(fd, "w")) == NULL) {
+		log_error("upgrade: fdopen failed:");
+		close(fd);
+		return false;
+	}
+	if (!write_state(f, &config.tasks, states, states_len, signal_time)) {
+		log_error("upgrade: failed to write state:");
+		fclose(f);
+		return false;
+	}
+
+	snprintf(env, sizeof(env), "%d", fd);
+	if (setenv(UPGRADE_ENV, env, 1) == -1) {
+		log_error("upgrade: setenv failed:");
+		fclose(f);
+		return false;
+	}
+
+	log_info("upgrade: executing %s", path);
+
+	// Hand over the X connections and shared pages cleanly, the new process
+	// sets them up again.
+	status_deinit();
+	history_deinit();
+	xss_deinit();
+	plugin_deinit();
+	events_deinit();
+
+	execv(path, argv);
+
+	log_fatal("upgrade: failed to execute %s:", path);
+}
+
+static bool
+read_task(FILE *f, struct upgrade_task *t, char **name)
+{
+	if (fread(t, sizeof(*t), 1, f) != 1) {
+		return false;
+	}
+	if ((*name = malloc(t->name_len + 1)) == NULL) {
+		return false;
+	}
+	if (fread(*name, 1, t->name_len, f) != t->name_len) {
+		free(*name);
+		return false;
+	}
+	(*name)[t->name_len] = '\0';
+	return true;
+}
+
+static bool
+restore_task(struct tasklist *tasks, const struct upgrade_task *t, char *name)
+{
+	struct task task = {0};
+	struct taskinfo info = {0};
+
+	for (size_t i = 0; i < tasks->len; i++) {
+		struct task *new_task = &tasks->entries[i];
+		struct taskinfo *new_info = &tasks->info[new_task->id];
+
+		// Running plugins are handed over as pending and pipelines never
+		// run during an upgrade, so a running task is a process and can't
+		// be merged into another kind.
+		if (strcmp(new_info->name, name) == 0 &&
+				!(t->state == TASK_STARTED && (new_task->flags & TASK_KIND))) {
+			new_task->state = t->state;
+			new_task->flags |= t->flags & TASK_FAILED;
+			new_task->pid = t->pid;
+			new_info->last_start = t->last_start;
+			new_info->last_exit = t->last_exit;
+			log_debug("upgrade: restored task '%s'", name);
+			free(name);
+			return true;
+		}
+	}
+
+	if (t->state != TASK_STARTED) {
+		free(name);
+		return true;
+	}
+
+	// Removed from the config but still running, only the name is needed
+	// to report on it once it's reaped.
+	task.state = TASK_STARTED;
+	task.flags = TASK_TEMPORARY | (t->flags & TASK_FAILED);
+	task.pid = t->pid;
+	info.name = name;
+	info.last_start = t->last_start;
+	if (!tasklist_append(tasks, &task, &info)) {
+		free(name);
+		return false;
+	}
+	log_debug("upgrade: keeping removed task '%s'", name);
+	return true;
+}
+
+// Picks up the state handed over by upgrade_exec(), if there is any. states
+// are only restored when the number of displays is unchanged.
+bool
+upgrade_restore(struct tasklist *tasks, struct state *states, size_t states_len,
+		time_t *signal_time)
+{
+	struct upgrade_header hdr;
+	const char *env;
+	char *end;
+	long fd;
+	FILE *f;
+	bool ok = false;
+
+	if ((env = getenv(UPGRADE_ENV)) == NULL) {
+		return true;
+	}
+
+	errno = 0;
+	fd = strtol(env, &end, 10);
+	unsetenv(UPGRADE_ENV);
+	if (errno != 0 || *end != '\0' || fd < 0 || fd > INT_MAX) {
+		log_error("upgrade: invalid %s", UPGRADE_ENV);
+		return false;
+	}
+
+	if ((f = fdopen(fd, "r")) == NULL) {
+		log_error("upgrade: fdopen failed:");
+		close(fd);
+		return false;
+	}
+	rewind(f);
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != UPGRADE_MAGIC ||
+			hdr.version != UPGRADE_VERSION) {
+		log_error("upgrade: incompatible state");
+		goto done;
+	}
+	*signal_time = hdr.signal_time;
+
+	for (uint32_t i = 0; i < hdr.states; i++) {
+		struct upgrade_state s;
+
+		if (fread(&s, sizeof(s), 1, f) != 1) {
+			log_error("upgrade: truncated state");
+			goto done;
+		}
+		if (hdr.states == states_len) {
+			states[i].idle = s.idle;
+			states[i].xss_active = s.xss_active;
+		}
+	}
+
+	for (uint32_t i = 0; i < hdr.tasks; i++) {
+		struct upgrade_task t;
+		char *name;
+
+		if (!read_task(f, &t, &name)) {
+			log_error("upgrade: truncated state");
+			goto done;
+		}
+		if (!restore_task(tasks, &t, name)) {
+			log_error("upgrade: failed to append task:");
+			goto done;
+		}
+	}
+
+	tasks->running = 0;
+	for (size_t i = 0; i < tasks->len; i++) {
+		if (tasks->entries[i].state == TASK_STARTED) {
+			tasks->running++;
+		}
+	}
+
+	log_info("upgrade: resumed %u tasks", hdr.tasks);
+	ok = true;
+
+done:
+	fclose(f);
+	return ok;
+}
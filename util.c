@@ -1,10 +1,14 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <pwd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "idlemon.h"
 
@@ -119,3 +123,80 @@ strtobool(const char *s)
 	return -1;
 }
 
+
+// An argv is a single allocation holding the NULL terminated pointer array
+// followed by the strings in order, see parse_argv().
+size_t
+argv_size(char *const *argv)
+{
+	size_t n = 0;
+
+	while (argv[n] != NULL) {
+		n++;
+	}
+	if (n == 0) {
+		return sizeof(*argv);
+	}
+	return (size_t)(argv[n - 1] + strlen(argv[n - 1]) + 1 - (char *)argv);
+}
+
+char **
+argv_dup(char *const *argv)
+{
+	size_t size = argv_size(argv);
+	char **dup;
+
+	if ((dup = malloc(size)) == NULL) {
+		return NULL;
+	}
+	memcpy(dup, argv, size);
+
+	// Rebase the pointers onto the copied strings
+	for (char **p = dup; *p != NULL; p++) {
+		*p = (char *)dup + (*p - (char *)argv);
+	}
+	return dup;
+}
+
+// Default path of the state file name, below $XDG_STATE_HOME/idlemon or
+// ~/.local/state/idlemon.
+char *
+state_filename(const char *name)
+{
+	char path[PATH_MAX];
+	char *env;
+	int r;
+
+	if ((env = getenv("XDG_STATE_HOME")) != NULL) {
+		r = snprintf(path, sizeof(path), "%s/idlemon/%s", env, name);
+	} else {
+		struct passwd *pw = getpwuid(getuid());
+		if (pw == NULL) {
+			log_error("failed to get password file entry for user:");
+			return NULL;
+		}
+		r = snprintf(path, sizeof(path), "%s/.local/state/idlemon/%s", pw->pw_dir, name);
+	}
+
+	if (r < 0 || (size_t)r >= sizeof(path)) {
+		log_error("%s: path overflow", name);
+		return NULL;
+	}
+	return strdup(path);
+}
+
+// Creates every missing parent directory of path.
+bool
+mkdir_parents(char *path)
+{
+	for (char *p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+			log_error("failed to create %s:", path);
+			*p = '/';
+			return false;
+		}
+		*p = '/';
+	}
+	return true;
+}
@@ -1,51 +1,981 @@
 
-#include <X11/X.h>
-#include <X11/Xlib.h>
-#include <X11/extensions/scrnsaver.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 
 #include "idlemon.h"
+#include "trace.h"
 
+// MIT-SCREEN-SAVER QueryInfo is declared here rather than pulling in
+// libxcb-screensaver for a single request.
+#define SCREENSAVER_QUERY_INFO 1
+#define SCREENSAVER_STATE_ON 1
 
-static Display *dpy = NULL;
-static XScreenSaverInfo *info = NULL;
+// Likewise for the two DPMS requests needed to force the monitor state.
+#define DPMS_ENABLE 4
+#define DPMS_FORCE_LEVEL 6
 
+// Entries of an Xauthority file that can apply to a local display, and the
+// only authorization used with them
+#define XAUTH_FAMILY_LOCAL 256
+#define XAUTH_FAMILY_WILD 65535
+#define XAUTH_COOKIE "MIT-MAGIC-COOKIE-1"
 
-void
-xss_init(void)
+// Longest xss_query() waits for the replies before returning older samples
+#define XSS_WAIT 250
+// Waits between attempts to connect again to a display, doubling each time
+#define XSS_BACKOFF_MIN 1000
+#define XSS_BACKOFF_MAX 60000
+
+struct dpms_enable_request {
+	uint8_t major_opcode;
+	uint8_t minor_opcode;
+	uint16_t length;
+};
+
+struct dpms_force_level_request {
+	uint8_t major_opcode;
+	uint8_t minor_opcode;
+	uint16_t length;
+	uint16_t power_level;
+	uint8_t pad[2];
+};
+
+struct screensaver_query_info_request {
+	uint8_t major_opcode;
+	uint8_t minor_opcode;
+	uint16_t length;
+	xcb_drawable_t drawable;
+};
+
+struct screensaver_query_info_reply {
+	uint8_t response_type;
+	uint8_t state;
+	uint16_t sequence;
+	uint32_t length;
+	xcb_window_t saver_window;
+	uint32_t ms_until_server;
+	uint32_t ms_since_user_input;
+	uint32_t event_mask;
+	uint8_t kind;
+	uint8_t pad[7];
+};
+
+struct display {
+	char *name;
+	// Authority file of a display from xss_add(), NULL to leave it to libxcb
+	char *xauthority;
+	xcb_connection_t *conn;
+	int screen;
+	xcb_window_t root;
+	// Added by xss_add(), once connected errors drop the connection rather
+	// than it being connected again
+	bool optional;
+	// Changed whenever the slot is reused, so the query thread can tell
+	// while it's connecting
+	uint32_t gen;
+	// Query in flight, with the monotonic time in ms it was sent
+	bool pending;
+	unsigned int cookie;
+	uint64_t sent;
+	// When to try connecting again after a failure, 0 if connected or
+	// given up on
+	uint64_t retry;
+	unsigned long backoff;
+	// DPMS is available, and a level xss_dpms() asked for that the query
+	// thread is yet to send
+	bool dpms;
+	bool dpms_pending;
+	enum dpms_level dpms_level;
+};
+
+// Latest reply from a display and the monotonic time in ms it arrived
+struct sample {
+	struct xss xss;
+	uint64_t at;
+};
+
+static xcb_extension_t screensaver_id = { "MIT-SCREEN-SAVER", 0 };
+static xcb_extension_t dpms_id = { "DPMS", 0 };
+
+// The displays are queried on their own thread, so a server that stops
+// answering can't hold up the main loop. lock covers the displays, which the
+// main thread only touches to add, remove or ask for a DPMS level, and the
+// thread only holds it to send requests and poll for replies, never waiting
+// on a server. Replies are published to samples under samples_lock, which is
+// never held across X requests.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct display *displays = NULL;
+static size_t displays_len = 0;
+static uint32_t gens = 0;
+
+static pthread_mutex_t samples_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t samples_cond;
+static struct sample *samples = NULL;
+// Rounds of queries asked for by xss_query() and sent by the thread, and the
+// number of displays yet to answer
+static uint64_t rounds_wanted = 0;
+static uint64_t rounds_sent = 0;
+static size_t outstanding = 0;
+
+// Owned by the main thread, returned by xss_query()
+static struct xss *results = NULL;
+
+static pthread_t thread;
+static bool running = false;
+static bool stopping = false;
+// Wakes the thread when a round is wanted or it should stop
+static int wake_fd = -1;
+
+static unsigned long timeout = XSS_TIMEOUT;
+static uint64_t stalls = 0;
+
+
+static uint64_t
+now_ms(void)
+{
+	return trace_now() / 1000000;
+}
+
+static const char *
+display_name(const struct display *d)
+{
+	return d->name != NULL ? d->name : "default";
+}
+
+// Reads one counted string of an Xauthority entry into buf. Returns its
+// length, skipping it if it's larger than size, or -1 at the end of the file.
+static long
+xauth_read(FILE *f, char *buf, size_t size)
+{
+	unsigned char len[2];
+	size_t n;
+
+	if (fread(len, 1, sizeof(len), f) != sizeof(len)) {
+		return -1;
+	}
+	n = (size_t)len[0] << 8 | len[1];
+	if (n > size) {
+		return fseek(f, n, SEEK_CUR) == 0 ? (long)n : -1;
+	}
+	return fread(buf, 1, n, f) == n ? (long)n : -1;
+}
+
+// Looks up the cookie for a local display in its Xauthority file, as libxcb
+// would from $XAUTHORITY, which can't be set per connection. The file is the
+// user's, so only a regular file is read and symlinks aren't followed.
+static bool
+display_auth(const struct display *d, xcb_auth_info_t *auth, char *data, size_t size)
+{
+	static char cookie[] = XAUTH_COOKIE;
+	char host[256] = "";
+	const char *number;
+	size_t host_len, number_len;
+	unsigned char family[2];
+	bool found = false;
+	struct stat st;
+	FILE *f;
+	int fd;
+
+	if ((number = strrchr(d->name, ':')) == NULL) {
+		return false;
+	}
+	number++;
+	number_len = strcspn(number, ".");
+	gethostname(host, sizeof(host) - 1);
+	host_len = strlen(host);
+
+	if ((fd = open(d->xauthority, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC)) == -1) {
+		return false;
+	}
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || (f = fdopen(fd, "r")) == NULL) {
+		close(fd);
+		return false;
+	}
+
+	while (!found && fread(family, 1, sizeof(family), f) == sizeof(family)) {
+		unsigned fam = family[0] << 8 | family[1];
+		char addr[256], num[32], name[32];
+		long addr_len, num_len, name_len, data_len;
+
+		if ((addr_len = xauth_read(f, addr, sizeof(addr))) == -1 ||
+				(num_len = xauth_read(f, num, sizeof(num))) == -1 ||
+				(name_len = xauth_read(f, name, sizeof(name))) == -1 ||
+				(data_len = xauth_read(f, data, size)) == -1) {
+			break;
+		}
+		found = (fam == XAUTH_FAMILY_WILD || (fam == XAUTH_FAMILY_LOCAL &&
+					(size_t)addr_len == host_len && memcmp(addr, host, host_len) == 0)) &&
+			(size_t)num_len == number_len && memcmp(num, number, number_len) == 0 &&
+			(size_t)name_len == strlen(cookie) && memcmp(name, cookie, name_len) == 0 &&
+			(size_t)data_len <= size;
+		if (found) {
+			*auth = (xcb_auth_info_t){
+				.namelen = name_len,
+				.name = cookie,
+				.datalen = data_len,
+				.data = data,
+			};
+		}
+	}
+
+	fclose(f);
+	return found;
+}
+
+static bool
+display_connect(struct display *d)
+{
+	xcb_auth_info_t auth;
+	char data[256];
+
+	// Without a matching entry libxcb looks for one itself, as a server may
+	// not need one
+	if (d->xauthority != NULL && display_auth(d, &auth, data, sizeof(data))) {
+		d->conn = xcb_connect_to_display_with_auth_info(d->name, &auth, &d->screen);
+	} else {
+		d->conn = xcb_connect(d->name, &d->screen);
+	}
+	if (xcb_connection_has_error(d->conn)) {
+		log_error("xss: failed to open display '%s'", display_name(d));
+		xcb_disconnect(d->conn);
+		d->conn = NULL;
+		return false;
+	}
+
+	// Don't wait for the reply here so the round-trips of all displays
+	// overlap.
+	xcb_prefetch_extension_data(d->conn, &screensaver_id);
+	xcb_prefetch_extension_data(d->conn, &dpms_id);
+	return true;
+}
+
+static bool
+display_setup(struct display *d)
+{
+	const xcb_query_extension_reply_t *ext;
+	xcb_screen_iterator_t it;
+	int screen = d->screen;
+
+	it = xcb_setup_roots_iterator(xcb_get_setup(d->conn));
+	for (; it.rem > 0 && screen > 0; screen--) {
+		xcb_screen_next(&it);
+	}
+	if (it.rem == 0) {
+		log_error("xss: invalid screen for display '%s'", display_name(d));
+		return false;
+	}
+	d->root = it.data->root;
+
+	ext = xcb_get_extension_data(d->conn, &screensaver_id);
+	if (ext == NULL || !ext->present) {
+		log_error("xss: extension not enabled on display '%s'", display_name(d));
+		return false;
+	}
+	// Resolved now, so the query thread never waits for it
+	ext = xcb_get_extension_data(d->conn, &dpms_id);
+	d->dpms = ext != NULL && ext->present;
+	return true;
+}
+
+// Starts a fresh sample for a display that was just connected, so it isn't
+// stale before its first reply.
+static void
+sample_reset(size_t i)
 {
-	int event_base;
-	int error_base;
+	pthread_mutex_lock(&samples_lock);
+	samples[i] = (struct sample){ .at = now_ms() };
+	pthread_mutex_unlock(&samples_lock);
+}
+
+static void
+sample_publish(size_t i, const struct xss *xss)
+{
+	pthread_mutex_lock(&samples_lock);
+	samples[i] = (struct sample){ .xss = *xss, .at = now_ms() };
+	outstanding--;
+	pthread_cond_broadcast(&samples_cond);
+	pthread_mutex_unlock(&samples_lock);
+}
+
+// Gives up on a display after an error or a stall. Optional displays are
+// forgotten and read as active, the others are connected again later.
+static void
+display_fail(size_t i, const char *reason)
+{
+	struct display *d = &displays[i];
+
+	__atomic_add_fetch(&stalls, 1, __ATOMIC_RELAXED);
+	xcb_disconnect(d->conn);
+	d->conn = NULL;
 
-	if ((dpy = XOpenDisplay(NULL)) == NULL) {
-		log_fatal("xss: failed to open display");
+	pthread_mutex_lock(&samples_lock);
+	if (d->pending) {
+		outstanding--;
+		pthread_cond_broadcast(&samples_cond);
 	}
+	if (d->optional) {
+		samples[i].xss = (struct xss){0};
+	}
+	pthread_mutex_unlock(&samples_lock);
+	d->pending = false;
+	d->dpms_pending = false;
+
+	if (d->optional) {
+		log_warn("xss: %s on display '%s', dropping it", reason, display_name(d));
+		return;
+	}
+	d->backoff = XSS_BACKOFF_MIN;
+	d->retry = now_ms() + d->backoff;
+	log_warn("xss: %s on display '%s', reconnecting", reason, display_name(d));
+}
+
+static unsigned int
+query_info_send(struct display *d)
+{
+	static const xcb_protocol_request_t req = {
+		.count = 2,
+		.ext = &screensaver_id,
+		.opcode = SCREENSAVER_QUERY_INFO,
+		.isvoid = 0,
+	};
+	struct screensaver_query_info_request out = {
+		.drawable = d->root,
+	};
+	struct iovec parts[4];
+
+	parts[2].iov_base = &out;
+	parts[2].iov_len = sizeof(out);
+	parts[3].iov_base = NULL;
+	parts[3].iov_len = 0;
+
+	return xcb_send_request(d->conn, XCB_REQUEST_CHECKED, parts + 2, &req);
+}
+
+// Sends a query to every connected display that isn't still answering the
+// last one.
+static void
+query_send(uint64_t round)
+{
+	uint64_t now = now_ms();
+	size_t sent = 0;
+
+	for (size_t i = 0; i < displays_len; i++) {
+		struct display *d = &displays[i];
 
-	if (XScreenSaverQueryExtension(dpy, &event_base, &error_base) == 0) {
-		log_fatal("xss: extension not enabled");
+		if (d->conn == NULL || d->pending) {
+			continue;
+		}
+		if ((d->cookie = query_info_send(d)) == 0 || xcb_flush(d->conn) <= 0) {
+			display_fail(i, "query failed");
+			continue;
+		}
+		d->pending = true;
+		d->sent = now;
+		sent++;
 	}
 
-	if ((info = XScreenSaverAllocInfo()) == NULL) {
+	// Both at once, so xss_query() doesn't see the round as answered before
+	// the queries are counted
+	pthread_mutex_lock(&samples_lock);
+	outstanding += sent;
+	rounds_sent = round;
+	pthread_cond_broadcast(&samples_cond);
+	pthread_mutex_unlock(&samples_lock);
+}
+
+// Collects the replies that have arrived and fails displays that took longer
+// than the timeout.
+static void
+query_collect(void)
+{
+	uint64_t now = now_ms();
+	unsigned long limit = __atomic_load_n(&timeout, __ATOMIC_RELAXED);
+
+	for (size_t i = 0; i < displays_len; i++) {
+		struct display *d = &displays[i];
+		struct screensaver_query_info_reply *reply = NULL;
+		xcb_generic_error_t *err = NULL;
+
+		if (!d->pending) {
+			continue;
+		}
+
+		if (!xcb_poll_for_reply(d->conn, d->cookie, (void **)&reply, &err)) {
+			if (xcb_connection_has_error(d->conn)) {
+				display_fail(i, "connection lost");
+			} else if (now - d->sent >= limit) {
+				display_fail(i, "no reply in time");
+			}
+			continue;
+		}
+
+		d->pending = false;
+		if (reply == NULL) {
+			free(err);
+			display_fail(i, "query failed");
+			continue;
+		}
+
+		sample_publish(i, &(struct xss){
+			.idle = reply->ms_since_user_input,
+			.active = reply->state == SCREENSAVER_STATE_ON,
+		});
+		free(reply);
+	}
+}
+
+// Connects to a display added by xss_add(), or again to one from the config
+// that failed, once it's due. The lock is dropped meanwhile as connecting
+// blocks for as long as the server doesn't answer, so the display is worked
+// on with copies of its names that xss_remove() can't free.
+static void
+display_retry(size_t i)
+{
+	struct display *d = &displays[i];
+	struct display tmp = {0};
+	uint32_t gen = d->gen;
+	bool ok = false;
+
+	if ((d->name == NULL || (tmp.name = strdup(d->name)) != NULL) &&
+			(d->xauthority == NULL || (tmp.xauthority = strdup(d->xauthority)) != NULL)) {
+		pthread_mutex_unlock(&lock);
+		pthread_cleanup_push(free, tmp.name);
+		pthread_cleanup_push(free, tmp.xauthority);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		ok = display_connect(&tmp) && display_setup(&tmp);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		pthread_cleanup_pop(1);
+		pthread_cleanup_pop(1);
+		pthread_mutex_lock(&lock);
+	} else {
+		log_error("xss: out of memory");
+		free(tmp.name);
+	}
+
+	d = &displays[i];
+	if (!ok || d->gen != gen || d->conn != NULL) {
+		if (tmp.conn != NULL) {
+			xcb_disconnect(tmp.conn);
+		}
+		if (!ok && d->gen == gen) {
+			d->backoff = d->backoff == 0 ? XSS_BACKOFF_MIN :
+				d->backoff * 2 < XSS_BACKOFF_MAX ? d->backoff * 2 : XSS_BACKOFF_MAX;
+			d->retry = now_ms() + d->backoff;
+		}
+		return;
+	}
+
+	d->conn = tmp.conn;
+	d->screen = tmp.screen;
+	d->root = tmp.root;
+	d->dpms = tmp.dpms;
+	d->retry = 0;
+	sample_reset(i);
+	log_info("xss: %s display '%s'", d->optional ? "connected to" : "reconnected to",
+			display_name(d));
+}
+
+static bool
+dpms_force_level(struct display *d, enum dpms_level level)
+{
+	static const xcb_protocol_request_t enable_req = {
+		.count = 2,
+		.ext = &dpms_id,
+		.opcode = DPMS_ENABLE,
+		.isvoid = 1,
+	};
+	static const xcb_protocol_request_t force_req = {
+		.count = 2,
+		.ext = &dpms_id,
+		.opcode = DPMS_FORCE_LEVEL,
+		.isvoid = 1,
+	};
+	struct dpms_enable_request enable = {0};
+	struct dpms_force_level_request force = {
+		.power_level = level,
+	};
+	struct iovec parts[4];
+
+	// Forcing a level has no effect unless DPMS is enabled
+	parts[2].iov_base = &enable;
+	parts[2].iov_len = sizeof(enable);
+	parts[3].iov_base = NULL;
+	parts[3].iov_len = 0;
+	xcb_send_request(d->conn, 0, parts + 2, &enable_req);
+
+	parts[2].iov_base = &force;
+	parts[2].iov_len = sizeof(force);
+	xcb_send_request(d->conn, 0, parts + 2, &force_req);
+
+	return xcb_flush(d->conn) > 0;
+}
+
+// Sends the DPMS levels asked for by xss_dpms().
+static void
+dpms_send(void)
+{
+	for (size_t i = 0; i < displays_len; i++) {
+		struct display *d = &displays[i];
+
+		if (!d->dpms_pending) {
+			continue;
+		}
+		d->dpms_pending = false;
+		if (d->conn != NULL && !dpms_force_level(d, d->dpms_level)) {
+			display_fail(i, "dpms request failed");
+		}
+	}
+}
+
+static void *
+query_thread(void *arg)
+{
+	(void)arg;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_mutex_lock(&lock);
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		// xss_add() may grow the displays while the lock is dropped
+		size_t pfds_len = 1 + displays_len;
+		struct pollfd pfds[pfds_len];
+		unsigned long limit = __atomic_load_n(&timeout, __ATOMIC_RELAXED);
+		uint64_t now = now_ms();
+		uint64_t round;
+		long wait = -1;
+		bool due;
+
+		pfds[0] = (struct pollfd){ .fd = wake_fd, .events = POLLIN };
+		for (size_t i = 0; i < displays_len; i++) {
+			struct display *d = &displays[i];
+			uint64_t at;
+
+			pfds[1 + i] = (struct pollfd){ .fd = -1, .events = POLLIN };
+			if (d->pending) {
+				pfds[1 + i].fd = xcb_get_file_descriptor(d->conn);
+				at = d->sent + limit;
+			} else if (d->conn == NULL && d->retry != 0) {
+				at = d->retry;
+			} else {
+				continue;
+			}
+			if (at <= now) {
+				wait = 0;
+			} else if (wait == -1 || (long)(at - now) < wait) {
+				wait = at - now;
+			}
+		}
+
+		// Only blocking in poll() or while connecting may the thread be
+		// cancelled, with the lock released
+		pthread_mutex_unlock(&lock);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		if (poll(pfds, pfds_len, wait) == -1 && errno != EINTR) {
+			log_error("xss: poll failed:");
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		pthread_mutex_lock(&lock);
+
+		if (pfds[0].revents & POLLIN) {
+			uint64_t n;
+			ssize_t rr = read(wake_fd, &n, sizeof(n));
+
+			(void)rr;
+			if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+		}
+
+		query_collect();
+		dpms_send();
+
+		now = now_ms();
+		for (size_t i = 0; i < displays_len; i++) {
+			struct display *d = &displays[i];
+
+			if (d->conn == NULL && d->retry != 0 && d->retry <= now) {
+				display_retry(i);
+			}
+		}
+
+		pthread_mutex_lock(&samples_lock);
+		round = rounds_wanted;
+		due = rounds_sent != round;
+		pthread_mutex_unlock(&samples_lock);
+		if (due) {
+			query_send(round);
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static void
+xss_start(void)
+{
+	pthread_condattr_t attr;
+	int err;
+
+	if (running) {
+		return;
+	}
+
+	// Waited on with a monotonic deadline by xss_query()
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&samples_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	if ((wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+		log_fatal("xss: eventfd failed:");
+	}
+	stopping = false;
+	if ((err = pthread_create(&thread, NULL, query_thread, NULL)) != 0) {
+		errno = err;
+		log_fatal("xss: failed to create thread:");
+	}
+	running = true;
+}
+
+static void
+xss_stop(void)
+{
+	uint64_t one = 1;
+	ssize_t r;
+
+	if (!running) {
+		return;
+	}
+
+	__atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+	r = write(wake_fd, &one, sizeof(one));
+	(void)r;
+	// In case it's stuck connecting to a server that doesn't answer
+	pthread_cancel(thread);
+	pthread_join(thread, NULL);
+
+	close(wake_fd);
+	wake_fd = -1;
+	pthread_cond_destroy(&samples_cond);
+	running = false;
+	rounds_wanted = rounds_sent = 0;
+	outstanding = 0;
+}
+
+// Grows the display arrays by one, with both locks held.
+static bool
+displays_grow(void)
+{
+	struct display *ds;
+	struct sample *ss;
+	struct xss *rs;
+
+	if ((ds = realloc(displays, (displays_len + 1) * sizeof(*ds))) == NULL) {
+		return false;
+	}
+	displays = ds;
+	if ((ss = realloc(samples, (displays_len + 1) * sizeof(*ss))) == NULL) {
+		return false;
+	}
+	samples = ss;
+	if ((rs = realloc(results, (displays_len + 1) * sizeof(*rs))) == NULL) {
+		return false;
+	}
+	results = rs;
+	displays_len++;
+	return true;
+}
+
+void
+xss_init(char *const *names)
+{
+	size_t n = 0;
+
+	if (names != NULL) {
+		for (char *const *p = names; *p != NULL; p++) {
+			n++;
+		}
+	}
+
+	// A NULL name means the display from $DISPLAY
+	displays_len = n > 0 ? n : 1;
+
+	if ((displays = calloc(displays_len, sizeof(*displays))) == NULL ||
+			(samples = calloc(displays_len, sizeof(*samples))) == NULL ||
+			(results = calloc(displays_len, sizeof(*results))) == NULL) {
 		log_fatal("xss: out of memory");
 	}
+
+	for (size_t i = 0; i < n; i++) {
+		if ((displays[i].name = strdup(names[i])) == NULL) {
+			log_fatal("xss: out of memory");
+		}
+	}
+
+	for (size_t i = 0; i < displays_len; i++) {
+		display_connect(&displays[i]);
+	}
+	for (size_t i = 0; i < displays_len; i++) {
+		struct display *d = &displays[i];
+
+		d->gen = ++gens;
+		samples[i].at = now_ms();
+		if (d->conn != NULL && display_setup(d)) {
+			continue;
+		}
+
+		// Left to the query thread to connect to like after a failure,
+		// stale until it answers
+		if (d->conn != NULL) {
+			xcb_disconnect(d->conn);
+			d->conn = NULL;
+		}
+		d->backoff = XSS_BACKOFF_MIN;
+		d->retry = now_ms() + d->backoff;
+		samples[i].at = 0;
+		log_warn("xss: display '%s' not available, retrying", display_name(d));
+	}
+
+	xss_start();
+	log_debug("xss: monitoring %zu display(s)", displays_len);
 }
 
 void
 xss_deinit(void)
 {
-	XFree(info);
-	XCloseDisplay(dpy);
+	xss_stop();
+
+	for (size_t i = 0; i < displays_len; i++) {
+		if (displays[i].conn != NULL) {
+			xcb_disconnect(displays[i].conn);
+		}
+		free(displays[i].name);
+		free(displays[i].xauthority);
+	}
+	free(displays);
+	free(samples);
+	free(results);
+
+	displays = NULL;
+	samples = NULL;
+	results = NULL;
+	displays_len = 0;
 }
 
-struct xss
+bool
+xss_changed(char *const *names)
+{
+	size_t n = 0;
+
+	if (names != NULL) {
+		for (; names[n] != NULL; n++) {
+			if (n >= displays_len || displays[n].name == NULL ||
+					strcmp(displays[n].name, names[n]) != 0) {
+				return true;
+			}
+		}
+	}
+
+	return n == 0 ? displays_len != 1 || displays[0].name != NULL : n != displays_len;
+}
+
+size_t
+xss_count(void)
+{
+	return displays_len;
+}
+
+// Sets how long a display may take to answer before it counts as stalled.
+void
+xss_timeout(unsigned long ms)
+{
+	__atomic_store_n(&timeout, ms, __ATOMIC_RELAXED);
+}
+
+// Number of times a display stopped answering or lost its connection.
+uint64_t
+xss_stalls(void)
+{
+	return __atomic_load_n(&stalls, __ATOMIC_RELAXED);
+}
+
+// Adds a display to monitor alongside those from xss_init(), connecting with
+// the given Xauthority file. The query thread connects to it, retrying until
+// it can, so it's stale until it first answers. Returns its index for
+// xss_query() results or SIZE_MAX if it can't be monitored.
+size_t
+xss_add(const char *name, const char *xauthority)
+{
+	struct display d = { .optional = true };
+	uint64_t one = 1;
+	ssize_t r;
+	size_t i;
+
+	if ((d.name = strdup(name)) == NULL || (d.xauthority = strdup(xauthority)) == NULL) {
+		free(d.name);
+		return SIZE_MAX;
+	}
+
+	xss_start();
+	pthread_mutex_lock(&lock);
+	pthread_mutex_lock(&samples_lock);
+	// Displays from xss_init() waiting to be connected again keep their slot
+	for (i = 0; i < displays_len; i++) {
+		if (displays[i].conn == NULL && displays[i].name == NULL && displays[i].retry == 0) {
+			break;
+		}
+	}
+	if (i == displays_len && !displays_grow()) {
+		pthread_mutex_unlock(&samples_lock);
+		pthread_mutex_unlock(&lock);
+		free(d.name);
+		free(d.xauthority);
+		return SIZE_MAX;
+	}
+	d.gen = ++gens;
+	d.retry = now_ms();
+	displays[i] = d;
+	samples[i] = (struct sample){0};
+	pthread_mutex_unlock(&samples_lock);
+	pthread_mutex_unlock(&lock);
+
+	r = write(wake_fd, &one, sizeof(one));
+	(void)r;
+	log_debug("xss: monitoring display '%s'", name);
+	return i;
+}
+
+void
+xss_remove(size_t i)
+{
+	struct display *d;
+
+	pthread_mutex_lock(&lock);
+	d = &displays[i];
+	if (d->conn != NULL) {
+		xcb_disconnect(d->conn);
+	}
+	free(d->name);
+	free(d->xauthority);
+
+	pthread_mutex_lock(&samples_lock);
+	if (d->pending) {
+		outstanding--;
+	}
+	samples[i] = (struct sample){0};
+	pthread_mutex_unlock(&samples_lock);
+
+	*d = (struct display){ .gen = ++gens };
+	pthread_mutex_unlock(&lock);
+}
+
+bool
+xss_connected(size_t i)
+{
+	bool connected;
+
+	pthread_mutex_lock(&lock);
+	connected = i < displays_len && displays[i].conn != NULL;
+	pthread_mutex_unlock(&lock);
+	return connected;
+}
+
+// Asks the query thread for fresh samples and returns them, waiting at most
+// XSS_WAIT for the replies. Displays whose last reply is older than the
+// timeout are marked stale.
+const struct xss *
 xss_query(void)
 {
-	if (XScreenSaverQueryInfo(dpy, XDefaultRootWindow(dpy), info) == 0) {
-		log_fatal("xss: query failed");
+	struct timespec deadline;
+	uint64_t one = 1;
+	uint64_t want;
+	uint64_t now;
+	ssize_t r;
+
+	if (!running) {
+		return results;
 	}
 
-	return (struct xss){
-		.idle = info->idle,
-		.active = info->state == ScreenSaverActive,
-	};
+	pthread_mutex_lock(&samples_lock);
+	want = ++rounds_wanted;
+	r = write(wake_fd, &one, sizeof(one));
+	(void)r;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += XSS_WAIT * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+	while (rounds_sent < want || outstanding > 0) {
+		if (pthread_cond_timedwait(&samples_cond, &samples_lock, &deadline) != 0) {
+			break;
+		}
+	}
+
+	now = now_ms();
+	for (size_t i = 0; i < displays_len; i++) {
+		results[i] = samples[i].xss;
+		results[i].stale = now - samples[i].at > __atomic_load_n(&timeout, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&samples_lock);
+
+	return results;
 }
 
+// Asks the query thread to force the DPMS level of a display, or of every
+// display when it's 0. Fails if one isn't connected or doesn't support DPMS,
+// a stall after the request is left to the thread like for queries.
+bool
+xss_dpms(size_t display, enum dpms_level level)
+{
+	uint64_t one = 1;
+	ssize_t r;
+	bool ok = true;
+
+	pthread_mutex_lock(&lock);
+	for (size_t i = 0; i < displays_len; i++) {
+		struct display *d = &displays[i];
+
+		if (display > 0 && i != display - 1) {
+			continue;
+		}
+		if (d->conn == NULL) {
+			// Only a failure when it's the one display asked for
+			ok = ok && display == 0;
+			continue;
+		}
+		if (!d->dpms) {
+			log_error("xss: dpms extension not enabled on display '%s'", display_name(d));
+			ok = false;
+			continue;
+		}
+		d->dpms_pending = true;
+		d->dpms_level = level;
+	}
+	if (display > displays_len) {
+		ok = false;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (running) {
+		r = write(wake_fd, &one, sizeof(one));
+		(void)r;
+	}
+	return ok;
+}